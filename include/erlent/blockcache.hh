@@ -0,0 +1,70 @@
+#ifndef _ERLENT_BLOCKCACHE_HH
+#define _ERLENT_BLOCKCACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/stat.h>
+#include <sys/types.h>
+}
+
+namespace erlent {
+
+    // Cache of file contents read from erlent-server, kept in a local
+    // directory across sessions (disabled unless enable() has been
+    // called). Each file is stored in blocks of BLOCK_SIZE bytes
+    // together with its size, inode number, mtime and ctime (in
+    // nanoseconds); when the file is opened with
+    // different attributes, its blocks are only used again after they
+    // have been compared with the checksums of the current version
+    // (see unverified() and verify()). The least recently
+    // used files are removed when the cache grows beyond its limit.
+    // Only one session uses a cache directory at a time.
+    class BlockCache {
+    public:
+        static const size_t BLOCK_SIZE = 128 * 1024;
+        static const uint64_t DEFAULT_MAX_BYTES = 1024ULL * 1024 * 1024;
+
+        class File;
+
+        // false if 'dir' cannot be used
+        static bool enable(const std::string &dir, uint64_t maxBytes = DEFAULT_MAX_BYTES);
+        static bool isEnabled();
+
+        // The cached contents of the regular file 'path' (nullptr if
+        // they cannot be cached), to be checked against 'stbuf'
+        // (the attributes of the file just opened).
+        static File *open(const std::string &path, const struct stat &stbuf);
+        static void close(File *file);
+
+        // Read from the cache; -1 if part of the range is not cached.
+        static ssize_t read(File *file, char *buf, size_t size, off_t offset);
+        // Store the result 'res' of reading 'len' bytes at the block
+        // boundary 'offset' from erlent-server.
+        static void store(File *file, const char *data, size_t len, ssize_t res, off_t offset);
+
+        // Blocks kept from an older version of the file are not read
+        // from the cache until verify() has been called for them. This
+        // returns the first run of at most 'max' of them that starts
+        // in the range of 'size' bytes at 'offset' (its offset in
+        // 'runOffset'), as the number of blocks (0 if there is none).
+        static size_t unverified(File *file, off_t offset, size_t size, size_t max, off_t &runOffset);
+        // Keep the blocks of the run of 'count' blocks at 'offset'
+        // whose contents match 'sums' (the SHA-256 digests of the
+        // blocks of the current version, see ChecksumsRequest), and
+        // drop the others.
+        static void verify(File *file, off_t offset, size_t count, const std::vector<std::string> &sums);
+
+        // 'path' may have changed: files open already stop using the
+        // cache, the attributes are checked again on the next open.
+        static void invalidate(const std::string &path);
+        // 'path' (and everything below it) has been modified: drop its
+        // contents.
+        static void discard(const std::string &path);
+    };
+}
+
+#endif // _ERLENT_BLOCKCACHE_HH
@@ -0,0 +1,60 @@
+#ifndef _ERLENT_BUFFER_HH
+#define _ERLENT_BUFFER_HH
+
+#include <cstddef>
+#include <utility>
+
+namespace erlent {
+
+    // Pool of I/O buffers in size classes (powers of two from
+    // MIN_SIZE to MAX_SIZE), shared by all threads. Larger buffers
+    // are not pooled.
+    class BufferPool {
+    public:
+        static const size_t MIN_SIZE = 4 * 1024;
+        static const size_t MAX_SIZE = 1024 * 1024;
+
+        // the actual size of a buffer for 'size' bytes
+        static size_t capacity(size_t size);
+
+        // get a buffer of capacity(size) bytes, put it back with the
+        // same 'size'
+        static char *get(size_t size);
+        static void put(char *buf, size_t size);
+    };
+
+    // A buffer from the pool, returned when the Buffer is destroyed.
+    class Buffer {
+        char *data;
+        size_t len;
+    public:
+        Buffer() : data(nullptr), len(0) { }
+        explicit Buffer(size_t size) : data(BufferPool::get(size)), len(size) { }
+        ~Buffer() { release(); }
+
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
+        void reset(size_t size) {
+            release();
+            data = BufferPool::get(size);
+            len = size;
+        }
+        void release() {
+            if (data != nullptr)
+                BufferPool::put(data, len);
+            data = nullptr;
+            len = 0;
+        }
+
+        void swap(Buffer &other) {
+            std::swap(data, other.data);
+            std::swap(len, other.len);
+        }
+
+        char *get() const { return data; }
+        size_t size() const { return len; }
+    };
+}
+
+#endif // _ERLENT_BUFFER_HH
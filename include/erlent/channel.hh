@@ -0,0 +1,289 @@
+#ifndef _ERLENT_CHANNEL_HH
+#define _ERLENT_CHANNEL_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+struct iovec;
+struct z_stream_s;
+
+namespace erlent {
+
+    class EofException { };
+
+    enum WireFormat { TEXT = 0, BINARY = 1 };
+
+    class Channel;
+    class LeaseHolder;
+    class SharedRing;
+
+    // Payloads of at least this size are moved with splice()/vmsplice()
+    // instead of being copied through user space.
+    static const size_t SPLICE_THRESHOLD = 64 * 1024;
+
+    // Compressible messages of at least this size are compressed when
+    // compression has been negotiated.
+    static const size_t COMPRESSION_THRESHOLD = 4 * 1024;
+
+    // The serialized form of one message. Header fields are encoded
+    // into an internal buffer; bulk data (at most one block, always the
+    // last field of a message) is kept separate from the header: it is
+    // only referenced (or waiting in a pipe) and sent without copying.
+    class Encoder {
+        WireFormat format;
+        std::string header;
+        const char *payload;
+        size_t payloadLen;
+        bool payloadStable;
+        int payloadPipe;
+        bool compressible;
+        std::vector<int> fds;   // passed along with the message
+
+        static thread_local std::string spareHeader;
+
+        friend class Channel;
+    public:
+        Encoder(WireFormat format);
+        ~Encoder();
+
+        Encoder(const Encoder &) = delete;
+        Encoder &operator=(const Encoder &) = delete;
+
+        WireFormat getFormat() const { return format; }
+
+        void reserve(size_t len) { header.reserve(header.size() + len); }
+        void write(const char *data, size_t len) { header.append(data, len); }
+        void writevarint(uint64_t value);
+
+        // 'stable' promises that 'data' is not modified before the peer
+        // has consumed the message (e.g., because the sender waits for
+        // the reply), so its pages may be passed on with vmsplice().
+        void setPayload(const char *data, size_t len, bool stable = false);
+        // The payload has been spliced into 'pipefd' already.
+        void setPayloadPipe(int pipefd, size_t len);
+
+        // The message contains bulk data worth compressing.
+        void setCompressible() { compressible = true; }
+
+        // Pass 'fd' to the peer with the message (it is duplicated
+        // for the peer, the caller still owns 'fd').
+        void addFd(int fd) { fds.push_back(fd); }
+
+        size_t size() const { return header.size() + payloadLen; }
+    };
+
+    // Reads the header fields of one message from a channel. In binary
+    // format, the header is buffered by the constructor; the destructor
+    // skips whatever has not been consumed. The payload stays in the
+    // channel until it is read, spliced or skipped.
+    class Decoder {
+        Channel &ch;
+    public:
+        Decoder(Channel &ch);
+        ~Decoder();
+
+        WireFormat getFormat() const;
+
+        char getc();
+        void read(char *data, size_t len);
+        uint64_t readvarint();
+
+        // Fail as for a truncated message unless 'len' more header
+        // bytes follow (lengths read off the wire are checked before
+        // anything is allocated for them; text is not framed, nothing
+        // is checked there).
+        void require(size_t len);
+
+        // The header is complete, 'len' bytes of payload follow.
+        void beginPayload(size_t len);
+        void readPayload(char *data, size_t len);
+
+        // the next file descriptor passed by the peer (-1 if none)
+        int receiveFd();
+    };
+
+    // A bidirectional message channel working directly on a pair of
+    // file descriptors: input is read into a buffer with as few read()
+    // calls as possible, each message is sent with a single writev()
+    // (followed by splice()/vmsplice() for large payloads).
+    //
+    // In binary format each message is preceded by the lengths of its
+    // header and of its payload (32 bits each, network byte order).
+    // If the COMPRESSED_FRAME bit is set in the first length, the rest
+    // of it is the length of the zlib-compressed header and payload,
+    // preceded by the (uncompressed) header length.
+    //
+    // On an AF_UNIX socket, file descriptors can be passed along with
+    // messages (SCM_RIGHTS); they are queued in the order of arrival.
+    //
+    // When a SharedRing has been negotiated, all messages go through
+    // it instead of the file descriptors.
+    class Channel {
+        static const uint32_t COMPRESSED_FRAME = 0x80000000;
+
+        int infd, outfd;
+        WireFormat format;
+
+        char *inbuf;
+        size_t bufsize, inpos, inend;
+        size_t frameLeft;    // unread header bytes of the current binary frame
+        size_t payloadLeft;  // unread payload bytes of the current message
+
+        std::mutex sendMutex;
+
+        // Compression is switched off for a while when the observed
+        // compression ratio is poor (e.g., for already compressed files).
+        bool compression;
+        std::mutex ratioMutex;
+        double ratio;        // moving average of compressed/uncompressed size
+        unsigned skipCompression;
+        struct ::z_stream_s *inflater;
+
+        bool fdPassing;
+        std::deque<int> receivedFds;
+
+        int ringFd;          // memfd of the shared ring offered, or -1
+        bool ringCreator;
+        SharedRing *ring;    // while the shared ring is used
+
+        LeaseHolder *leaseHolder;
+
+        ssize_t readSome(char *data, size_t len);
+        void fill(size_t n);
+        void beginFrame();
+        void inflateFrame(size_t clen, size_t plen);
+        bool shouldCompress(const Encoder &enc);
+        bool sendCompressed(Encoder &enc);
+        void updateRatio(size_t compressed, size_t uncompressed);
+        void endFrame();
+        void beginPayload(size_t len);
+        void require(size_t n);
+        void consume(size_t n);
+        char getc();
+        void read(char *data, size_t len);
+        void readDirect(char *data, size_t len);
+        void writeAll(const char *data, size_t len);
+        ssize_t writeFds(const struct ::iovec *iov, int iovcnt, const std::vector<int> &fds);
+        void writePayload(const Encoder &enc);
+
+        friend class Decoder;
+    public:
+        Channel(int infd, int outfd);
+        ~Channel();
+
+        Channel(const Channel &) = delete;
+        Channel &operator=(const Channel &) = delete;
+
+        WireFormat getFormat() const { return format; }
+        void setFormat(WireFormat fmt) { format = fmt; }
+
+        void setCompression(bool on);
+        bool isCompressing() const { return compression; }
+
+        // whether both ends of the channel are a Unix socket
+        bool isUnixSocket() const;
+        void setFdPassing(bool on);
+        bool isPassingFds() const { return fdPassing; }
+        int receiveFd();
+
+        // The shared ring in 'memfd' can be used once both sides have
+        // agreed on it (the channel owns 'memfd' then). 'creator' is
+        // true for the side which has created it.
+        void offerSharedRing(int memfd, bool creator);
+        bool hasSharedRing() const { return ringFd != -1; }
+        void setSharedRing(bool on);
+        bool isUsingSharedRing() const { return ring != nullptr; }
+
+        // Results leased to the peer are registered with 'holder'
+        // (nullptr if leases are not used on this channel).
+        void setLeaseHolder(LeaseHolder *holder) { leaseHolder = holder; }
+        LeaseHolder *getLeaseHolder() const { return leaseHolder; }
+
+        // Make a receive() blocked in another thread fail, if possible
+        // (not for pipes); returns whether it is possible.
+        bool interrupt();
+
+        int getInFd() const  { return infd; }
+        int getOutFd() const { return outfd; }
+
+        void send(Encoder &enc);
+
+        // Consume the payload of the last message received: copy it
+        // to 'data', write it to 'fd' at 'offset' (with splice() where
+        // possible; returns the number of bytes written or -errno, the
+        // payload is consumed in any case), or discard it.
+        void readPayload(char *data, size_t len);
+        ssize_t splicePayload(int fd, off_t offset, size_t len);
+        void skipPayload();
+    };
+
+    // Move up to 'len' bytes at 'offset' of 'fd' into a per-thread pipe
+    // whose read end is returned in 'pipefd'. Returns the number of bytes
+    // moved (less than 'len' only at end of file) or -1 if splicing
+    // is not possible for this file (nothing has been moved then).
+    ssize_t spliceToPipe(int fd, off_t offset, size_t len, int &pipefd);
+
+
+    // zigzag encoding maps small negative numbers to small varints
+    template<typename T>
+    static inline uint64_t zigzag(T value) {
+        if (!std::is_signed<T>::value)
+            return (uint64_t)value;
+        int64_t v = (int64_t)value;
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    template<typename T>
+    static inline T unzigzag(uint64_t value) {
+        if (!std::is_signed<T>::value)
+            return (T)value;
+        return (T)((int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+    }
+
+    template<typename T>
+    static inline Encoder &writenum(Encoder &enc, T value) {
+        if (enc.getFormat() == BINARY) {
+            enc.writevarint(zigzag(value));
+        } else {
+            const std::string &str = std::to_string(value);
+            enc.write(str.c_str(), str.length() + 1);
+        }
+        return enc;
+    }
+
+    template<typename T>
+    static Decoder &readnum(Decoder &dec, T &var) {
+        if (dec.getFormat() == BINARY) {
+            var = unzigzag<T>(dec.readvarint());
+            return dec;
+        }
+        char c;
+        bool neg = false;
+        var = 0;
+        do {
+            c = dec.getc();
+            if (c == '-')
+                neg = true;
+            else if (c != '\0')
+                var = (var * 10) + (T)(c - '0');
+        } while (c != '\0');
+        if (neg)
+            var = -var;
+        return dec;
+    }
+
+    Encoder &writestr(Encoder &enc, const std::string &str);
+    Decoder &readstr (Decoder &dec,       std::string &str);
+}
+
+#endif // _ERLENT_CHANNEL_HH
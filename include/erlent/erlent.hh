@@ -9,6 +9,10 @@
 #include <set>
 #include <vector>
 
+#include "erlent/buffer.hh"
+#include "erlent/channel.hh"
+#include "erlent/fields.hh"
+
 extern "C" {
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -18,77 +22,106 @@ extern "C" {
 
 
 namespace erlent {
+    // Protocol versions negotiated by the HELLO handshake. Version 1 is
+    // the original text format (numbers as decimal strings terminated
+    // by '\0'), version 2 the binary format (varint encoded numbers,
+    // every message preceded by a 32 bit length header).
+    enum ProtocolVersion { PROTOCOL_TEXT = 1, PROTOCOL_BINARY = 2,
+                           PROTOCOL_MAX = PROTOCOL_BINARY };
+
+    // Optional features of the binary protocol, requested by the client
+    // in its HELLO; the server enables those it supports.
+    enum Feature { FEATURE_COMPRESSION = 1 << 0, FEATURE_FD_PASSING = 1 << 1,
+                   FEATURE_SHARED_RING = 1 << 2, FEATURE_LEASES = 1 << 3 };
+    static const unsigned SUPPORTED_FEATURES =
+        FEATURE_COMPRESSION | FEATURE_FD_PASSING | FEATURE_SHARED_RING | FEATURE_LEASES;
+
     class GlobalOptions {
     private:
             static bool debug;
+            static int maxProtocol;
+            static unsigned features;
     public:
             static bool isDebug();
             static void setDebug(bool dbg);
+            static int getMaxProtocol();
+            static void setMaxProtocol(int version);
+            static unsigned getFeatures();
+            static void setFeatures(unsigned features);
     };
 
-    class EofException { };
-
     std::ostream &dbg();
 
-    std::ostream &writestr(std::ostream &os, const std::string &str);
-    std::istream &readstr (std::istream &is,       std::string &str);
-    std::ostream &writetimespec(std::ostream &os, const struct timespec &ts);
-    std::istream &readtimespec (std::istream &is,       struct timespec &ts);
-
-    template<typename T>
-    static inline std::ostream &writenum(std::ostream &os, T value) {
-        os << std::dec << value << '\0';
-        return os;
-    }
-
-    char getnextchar(std::istream &is);
-
-    template<typename T>
-    static std::istream &readnum(std::istream &is, T &var) {
-        char c;
-        bool neg = false;
-        var = 0;
-        do {
-            c = getnextchar(is);
-            if (c == '-')
-                neg = true;
-            else if (c != '\0')
-                var = (var * 10) + (T)(c - '0');
-        } while (c != '\0');
-        if (neg)
-            var = -var;
-        return is;
-    }
-
-
     class Message {
     public:
         enum Type { GETATTR=42, ACCESS, READDIR, READLINK, MKNOD,
                     READ, WRITE, OPEN, CREAT, TRUNCATE, CHMOD, CHOWN,
                     MKDIR, UNLINK, RMDIR, UTIMENS, SYMLINK, LINK, RENAME,
-                    STATFS };
+                    STATFS, HELLO, COMPOUND, READDIRPLUS, INVALIDATE, MANIFEST,
+                    CHECKSUMS };
+        // range of the message types (update when adding a type)
+        static const int FIRST_TYPE = GETATTR, LAST_TYPE = CHECKSUMS;
     protected:
-        Message() { }
+        // In binary format, each request carries a tag which is copied
+        // to its reply, so replies can be matched to outstanding
+        // requests when they arrive out of order.
+        uint32_t tag;
+
+        Message() : tag(0) { }
         virtual ~Message() { }
     public:
+        uint32_t getTag() const      { return tag; }
+        void setTag(uint32_t tag)    { this->tag = tag; }
+
         virtual Type getMessageType() const = 0;
-        virtual void serialize(std::ostream &os) const = 0;
-        virtual void deserialize(std::istream &is) = 0;
+        virtual void serialize(Encoder &enc) const = 0;
+        virtual void deserialize(Decoder &dec) = 0;
+        // exact size of the serialized message (without bulk data)
+        virtual size_t encodedSize(WireFormat format) const = 0;
+        virtual void print(std::ostream &os) const = 0;
+
+        // Serialize the message in the wire format of 'ch' and send it.
+        void send(Channel &ch) const;
 
         static std::string typeName(Type ty);
     };
 
     class Reply;
+    class RequestProcessor;
 
     class Request : public Message {
     public:
-        static Request *receive(std::istream &is);
-
-        virtual void perform(std::ostream &os);
+        static Request *receive(Channel &ch);
+        // new, empty request of type 'ty' (nullptr for unknown types)
+        static Request *create(Message::Type ty);
+
+        virtual void perform(Channel &ch);
+        // Like perform(), but the reply is not sent (it is part of the
+        // reply to a COMPOUND request); buffers needed by the reply
+        // are owned by the request.
+        virtual void performNested(Channel &ch) { performLocally(); }
         virtual void performLocally() = 0;
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        // Read the payload of a received request (if any) into memory,
+        // so that the request can be performed after the next messages
+        // have been received.
+        virtual void receivePayload(Channel &) { }
+
+        // Requests with the same ordering path are performed in the
+        // order of their arrival by a concurrent erlent-server (empty
+        // if the request may be reordered freely).
+        virtual const std::string &getOrderingPath() const;
+
+        // Called before a received request is reused (see RequestPool):
+        // release what the last use has left in the request.
+        virtual void reset() { }
+
+        // message type and tag
+        void writeHeader(Encoder &enc) const;
+        void readHeader(Decoder &dec);
+        size_t headerSize(WireFormat format) const;
+        void printHeader(std::ostream &os) const;
+        template<typename F> void fields(F &) { }
 
         virtual Reply &getReply() = 0;
     };
@@ -96,15 +129,27 @@ namespace erlent {
     class Reply : public Message {
         int result;
     public:
-        void receive(std::istream &is);
+        void receive(Channel &ch);
+
+        // receive() split in two parts for demultiplexing: read type and
+        // tag of the next reply, then decode the rest into the Reply
+        // object waiting for this tag.
+        static void receiveHeader(Decoder &dec, int &msgtype, uint32_t &tag);
+        void decode(Decoder &dec, int msgtype);
         int  getResult() const  { return result; }
         const char *getResultMessage() const {
             return result < 0 ? strerror(-result) : "Success";
         }
         void setResult(int res) { result = res; }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        // message type and tag (the result is a field)
+        void writeHeader(Encoder &enc) const;
+        void readHeader(Decoder &) { }
+        size_t headerSize(WireFormat format) const;
+        void printHeader(std::ostream &os) const;
+        template<typename F> void fields(F &f) { f("result", result); }
+
+        ERLENT_FIELDS
     };
 
     template<enum Message::Type MessageTy>
@@ -127,15 +172,11 @@ namespace erlent {
             this->pathname = pathname;
         }
 
-        void serialize(std::ostream &os) const {
-            this->Request::serialize(os);
-            writestr(os, pathname);
-        }
+        const std::string &getOrderingPath() const { return pathname; }
 
-        void deserialize(std::istream &is) {
-            this->Request::deserialize(is);
-            readstr(is, pathname);
-        }
+        template<typename F> void fields(F &f) { f("path", pathname); }
+
+        ERLENT_FIELDS
     };
 
     template<typename ReplyTy, enum Message::Type MsgType>
@@ -167,15 +208,12 @@ namespace erlent {
             this->pathname2 = pathname2;
         }
 
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathname::serialize(os);
-            writestr(os, pathname2);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("path2", pathname2);
         }
 
-        void deserialize(std::istream &is) {
-            this->RequestWithPathname::deserialize(is);
-            readstr(is, pathname2);
-        }
+        ERLENT_FIELDS
     };
 
     template<typename ReplyTy, enum Message::Type MsgType>
@@ -201,15 +239,12 @@ namespace erlent {
         RequestWithPathVal(const char *pathname, VALTY val)
             : RequestWithPathnameTempl<ReplyTy, MsgType>(pathname), val(val) { }
 
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathnameTempl<ReplyTy, MsgType>::serialize(os);
-            writenum(os, val);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("val", val);
         }
 
-        void deserialize(std::istream &is) {
-            this->RequestWithPathnameTempl<ReplyTy, MsgType>::deserialize(is);
-            readnum(is, val);
-        }
+        ERLENT_FIELDS
     };
 
     class UidGid {
@@ -221,13 +256,9 @@ namespace erlent {
         void setGid(gid_t gid) { this->gid = gid; }
         uid_t getUid() const { return uid; }
         gid_t getGid() const { return gid; }
-        void serialize(std::ostream &os) const {
-            writenum(os, uid);
-            writenum(os, gid);
-        }
-        void deserialize(std::istream &is) {
-            readnum(is, uid);
-            readnum(is, gid);
+        template<typename F> void fields(F &f) {
+            f("uid", uid);
+            f("gid", gid);
         }
     };
 
@@ -237,28 +268,41 @@ namespace erlent {
     public:
         void setMode(mode_t mode) { this->mode = mode; }
         mode_t getMode() const { return mode; }
-        void serialize(std::ostream &os) const { writenum(os, mode); }
-        void deserialize(std::istream &is) { readnum(is, mode); }
+        template<typename F> void fields(F &f) { f("mode", mode); }
     };
 
 
+    // With FEATURE_LEASES, erlent-server may lease the result to the
+    // client: it can be used for 'lease' seconds unless an INVALIDATE
+    // message for the path arrives before.
     class GetattrReply : public ReplyTempl<Message::GETATTR> {
         struct stat *stbuf;
+        uint32_t lease;
     public:
-        void init(struct stat *stbuf) { this->stbuf = stbuf; }
+        void init(struct stat *stbuf) { this->stbuf = stbuf; lease = 0; }
         struct stat *getStbuf() { return stbuf; }
+        void setLease(uint32_t seconds) { lease = seconds; }
+        uint32_t getLease() const { return lease; }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("stat", *stbuf);
+            f("lease", lease);
+        }
+
+        ERLENT_FIELDS
 
         Message::Type getMessageType() const { return Message::GETATTR; }
     };
 
     class GetattrRequest : public RequestWithPathnameTempl<GetattrReply, Message::GETATTR> {
+        struct stat stbuf;  // for performNested()
+        void grantLease(Channel &ch);
     public:
         using Super::RequestWithPathnameTempl;
 
-        void perform(std::ostream &os);
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
         void performLocally();
     };
 
@@ -271,20 +315,40 @@ namespace erlent {
         AccessRequest() { }
         AccessRequest(const char *pathname, int acc)
             : RequestWithPathnameTempl(pathname), acc(acc) { }
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("acc", acc);
+        }
+
+        ERLENT_FIELDS
+
         void performLocally();
     };
 
+    // A page of a directory listing: when 'cookie' is not 0, the
+    // listing continues after the entry it refers to.
     class ReaddirReply : public ReplyTempl<Message::READDIR> {
         std::vector<std::string> names;
+        uint64_t cookie;
     public:
         typedef std::vector<std::string>::const_iterator name_iterator;
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        ReaddirReply() : cookie(0) { }
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("names", names);
+            f("cookie", cookie);
+        }
+
+        ERLENT_FIELDS
 
         void addName(const std::string &name) { names.push_back(name); }
+        void clear() { names.clear(); cookie = 0; }
+        size_t size() const { return names.size(); }
+        void setCookie(uint64_t c) { cookie = c; }
+        uint64_t getCookie() const { return cookie; }
 
         name_iterator names_begin() const { return names.begin(); }
         name_iterator names_end()   const { return names.end();   }
@@ -292,25 +356,161 @@ namespace erlent {
         void filter(std::function<bool (const std::string&)> pred);
     };
 
+    // Lists the directory from the beginning (cookie 0) or after the
+    // entry the cookie of a previous reply refers to, at most
+    // 'maxEntries' entries (0: all of them).
     class ReaddirRequest : public RequestWithPathnameTempl<ReaddirReply, Message::READDIR> {
+        uint64_t cookie;
+        uint32_t maxEntries;
     public:
+        ReaddirRequest() : cookie(0), maxEntries(0) { }
+        ReaddirRequest(const char *pathname, uint64_t cookie = 0, uint32_t maxEntries = 0)
+            : RequestWithPathnameTempl(pathname), cookie(cookie), maxEntries(maxEntries) { }
+
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("cookie", cookie);
+            f("max", maxEntries);
+        }
+
+        ERLENT_FIELDS
+
+        void performLocally();
+        void reset() { reply.clear(); }
+    };
+
+    // Like ReaddirReply, but with the attributes of each entry (as
+    // returned by GETATTR; st_mode is 0 if they could not be
+    // determined) and the cookie to continue after it.
+    class ReaddirplusReply : public ReplyTempl<Message::READDIRPLUS> {
+    public:
+        struct Entry {
+            std::string name;
+            struct stat stbuf;
+            uint64_t cookie;
+
+            template<typename F> void fields(F &f) {
+                f("name", name);
+                f("stat", stbuf);
+                f("cookie", cookie);
+            }
+        };
+        typedef std::vector<Entry>::iterator entry_iterator;
+    private:
+        std::vector<Entry> entries;
+        uint64_t cookie;
+    public:
+        ReaddirplusReply() : cookie(0) { }
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("entries", entries);
+            f("cookie", cookie);
+        }
+
+        ERLENT_FIELDS
+
+        void addEntry(const std::string &name, const struct stat &stbuf, uint64_t cookie) {
+            entries.push_back(Entry{name, stbuf, cookie});
+        }
+        void clear() { entries.clear(); cookie = 0; }
+        size_t size() const { return entries.size(); }
+        void setCookie(uint64_t c) { cookie = c; }
+        uint64_t getCookie() const { return cookie; }
+
+        entry_iterator entries_begin() { return entries.begin(); }
+        entry_iterator entries_end()   { return entries.end();   }
+
+        void filter(std::function<bool (const std::string&)> pred);
+    };
+
+    class ReaddirplusRequest : public RequestWithPathnameTempl<ReaddirplusReply, Message::READDIRPLUS> {
+        uint64_t cookie;
+        uint32_t maxEntries;
+    public:
+        ReaddirplusRequest() : cookie(0), maxEntries(0) { }
+        ReaddirplusRequest(const char *pathname, uint64_t cookie = 0, uint32_t maxEntries = 0)
+            : RequestWithPathnameTempl(pathname), cookie(cookie), maxEntries(maxEntries) { }
+
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("cookie", cookie);
+            f("max", maxEntries);
+        }
+
+        ERLENT_FIELDS
+
+        void performLocally();
+        void reset() { reply.clear(); }
+    };
+
+    // The paths below a directory (relative to it, "" for the directory
+    // itself) with their attributes and the targets of symbolic links,
+    // as leased by erlent-server (with FEATURE_LEASES): until the lease
+    // ends or an INVALIDATE message for the directory arrives, lookups
+    // can be answered from the manifest. Directories marked LISTED have
+    // all their entries in the manifest; the walk stops before
+    // MAX_ENTRIES would be exceeded.
+    class ManifestReply : public ReplyTempl<Message::MANIFEST> {
+    public:
+        enum { LISTED = 1 };
+
+        struct Entry {
+            std::string name;
+            struct stat stbuf;
+            std::string target;
+            uint32_t flags;
+
+            template<typename F> void fields(F &f) {
+                f("name", name);
+                f("stat", stbuf);
+                f("target", target);
+                f("flags", flags);
+            }
+        };
+    private:
+        std::vector<Entry> entries;
+        uint32_t lease;
+    public:
+        ManifestReply() : lease(0) { }
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("entries", entries);
+            f("lease", lease);
+        }
+
+        ERLENT_FIELDS
+
+        std::vector<Entry> &getEntries() { return entries; }
+        void setLease(uint32_t seconds) { lease = seconds; }
+        uint32_t getLease() const { return lease; }
+        void clear() { entries.clear(); lease = 0; }
+    };
+
+    class ManifestRequest : public RequestWithPathnameTempl<ManifestReply, Message::MANIFEST> {
+    public:
+        static const size_t MAX_ENTRIES = 32768;
+
         using Super::RequestWithPathnameTempl;
 
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
+        // (fails, there is nobody to lease the manifest to)
         void performLocally();
+        void reset() { reply.clear(); }
     };
 
     class ReadlinkReply : public ReplyTempl<Message::READLINK> {
         std::string target;
     public:
-        void serialize(std::ostream &os) const {
-            this->ReplyTempl<Message::READLINK>::serialize(os);
-            writestr(os, target);
-        }
-        void deserialize(std::istream &is) {
-            this->ReplyTempl<Message::READLINK>::deserialize(is);
-            readstr(is, target);
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("target", target);
         }
 
+        ERLENT_FIELDS
+
         void setTarget(const char *t) { target = t; }
         const std::string &getTarget() const { return target; }
     };
@@ -325,54 +525,84 @@ namespace erlent {
     class ReadReply : public ReplyTempl<Message::READ> {
         char *data;
         size_t len;  // size of data array (to prevent buffer overruns)
+        int pipefd;  // data has been spliced into this pipe instead
     public:
-        ReadReply() { }
+        ReadReply() : pipefd(-1) { }
 
-        void init(char *data, size_t len) { this->data = data; this->len = len; }
+        void init(char *data, size_t len) {
+            this->data = data; this->len = len; pipefd = -1;
+        }
+        void initPipe(int pipefd) { data = nullptr; len = 0; this->pipefd = pipefd; }
         char *getData() { return data; }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        // the data is the payload, not a field
+        void serialize(Encoder &enc) const override;
+        void deserialize(Decoder &dec) override;
     };
 
     class ReadRequest : public RequestWithPathnameTempl<ReadReply, Message::READ> {
         size_t size;
         off_t offset;
+        Buffer buffer;  // reply data when performed by erlent-server
     public:
         ReadRequest() { }
 
         ReadRequest(const char *pathname, size_t size, off_t offset)
             : RequestWithPathnameTempl(pathname), size(size), offset(offset) { }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        size_t getSize() const   { return size; }
+        off_t  getOffset() const { return offset; }
+        void setSize(size_t size)     { this->size = size; }
+        void setOffset(off_t offset)  { this->offset = offset; }
+
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("size", size);
+            f("offset", offset);
+        }
 
-        void perform(std::ostream &os);
+        ERLENT_FIELDS
+
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
         void performLocally();
+        void reset() { buffer.release(); }
+    private:
+        bool performSpliced(Channel &ch);
     };
 
     class WriteReply : public ReplyTempl<Message::WRITE> {
     };
 
+    // After deserialize(), the data is still waiting in the channel;
+    // perform() writes it to the file directly (with splice()).
     class WriteRequest : public RequestWithPathnameTempl<WriteReply, Message::WRITE> {
         const char *data;
         size_t size;
         off_t offset;
-        bool del_data;
+        Buffer buffer;  // data read by receivePayload()
     public:
-        WriteRequest() { }
+        WriteRequest() : data(nullptr) { }
         WriteRequest(const char *pathname, const char *data, size_t size, off_t offset)
-            : RequestWithPathnameTempl(pathname), data(data), size(size), offset(offset), del_data(false) { }
+            : RequestWithPathnameTempl(pathname), data(data), size(size), offset(offset) { }
 
-        ~WriteRequest() {
-            if (del_data)
-                delete data;
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("size", size);
+            f("offset", offset);
         }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        // the data is the payload, not a field
+        void serialize(Encoder &enc) const override;
+        void deserialize(Decoder &dec) override;
+        size_t encodedSize(WireFormat format) const override { return fieldsSize(*this, format); }
+        void print(std::ostream &os) const override { printFields(*this, os); }
 
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
         void performLocally();
+        void receivePayload(Channel &ch);
+        void reset() { buffer.release(); }
     };
 
     class CreatReply : public ReplyTempl<Message::CREAT> {
@@ -382,13 +612,42 @@ namespace erlent {
     public:
         using RequestWithPathnameTempl::RequestWithPathnameTempl;
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            this->UidGid::fields(f);
+            this->Mode::fields(f);
+        }
+
+        ERLENT_FIELDS
 
         void performLocally();
     };
 
+    // With FEATURE_FD_PASSING, the file opened by erlent-server is
+    // passed along with the reply, so that the client can read and
+    // write it directly.
     class OpenReply : public ReplyTempl<Message::OPEN> {
+        int fd;         // the open file, or -1
+        int passedFds;  // number of file descriptors passed (0 or 1)
+    public:
+        OpenReply() : fd(-1), passedFds(0) { }
+        ~OpenReply() { closeFd(); }
+
+        // the caller owns the file descriptor afterwards
+        int takeFd() { int res = fd; fd = -1; passedFds = 0; return res; }
+        void setFd(int fd) { closeFd(); this->fd = fd; passedFds = fd != -1; }
+        void closeFd();
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("fds", passedFds);
+        }
+
+        // the file descriptor is not a field
+        void serialize(Encoder &enc) const override;
+        void deserialize(Decoder &dec) override;
+        size_t encodedSize(WireFormat format) const override { return fieldsSize(*this, format); }
+        void print(std::ostream &os) const override { printFields(*this, os); }
     };
 
     class OpenRequest : public RequestWithPathnameTempl<OpenReply,Message::OPEN>, public Mode {
@@ -401,10 +660,18 @@ namespace erlent {
         int getFlags() const     { return flags; }
         void setFlags(int flags) { this->flags = flags; }
 
-        void serialize(std::ostream &os) const;
-        void deserialize(std::istream &is);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            this->Mode::fields(f);
+            f("flags", flags);
+        }
+
+        ERLENT_FIELDS
 
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
         void performLocally();
+        void reset() { getReply().closeFd(); }
     };
 
     class TruncateReply : public ReplyTempl<Message::TRUNCATE> {
@@ -433,17 +700,14 @@ namespace erlent {
     class MknodRequest : public RequestWithPathVal<MknodReply, Message::MKNOD, dev_t>, public UidGid, public Mode {
     public:
         using RequestWithPathVal::RequestWithPathVal;
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathVal::serialize(os);
-            this->UidGid::serialize(os);
-            this->Mode::serialize(os);
-        }
-        void deserialize(std::istream &is) {
-            this->RequestWithPathVal::deserialize(is);
-            this->UidGid::deserialize(is);
-            this->Mode::deserialize(is);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathVal::fields(f);
+            this->UidGid::fields(f);
+            this->Mode::fields(f);
         }
 
+        ERLENT_FIELDS
+
         void performLocally();
     };
 
@@ -455,15 +719,13 @@ namespace erlent {
         ChownRequest() { }
         ChownRequest(const char *pathname)
             : RequestWithPathnameTempl<ChownReply, Message::CHOWN>(pathname) { }
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathnameTempl<ChownReply, Message::CHOWN>::serialize(os);
-            this->UidGid::serialize(os);
-        }
-        void deserialize(std::istream &is) {
-            this->RequestWithPathnameTempl<ChownReply, Message::CHOWN>::deserialize(is);
-            this->UidGid::deserialize(is);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            this->UidGid::fields(f);
         }
 
+        ERLENT_FIELDS
+
         void performLocally();
     };
 
@@ -480,17 +742,14 @@ namespace erlent {
         SymlinkRequest() { }
         SymlinkRequest(const char *from, const char *to)
             : RequestWithPathnameTempl(to), from(from) { }
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathnameTempl::serialize(os);
-            this->UidGid::serialize(os);
-            writestr(os, from);
-        }
-        void deserialize(std::istream &is) {
-            this->RequestWithPathnameTempl::deserialize(is);
-            this->UidGid::deserialize(is);
-            readstr(is, from);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            this->UidGid::fields(f);
+            f("from", from);
         }
 
+        ERLENT_FIELDS
+
         const std::string &getFrom() const { return from; }
 
         void performLocally();
@@ -505,6 +764,53 @@ namespace erlent {
         void performLocally();
     };
 
+    class ChecksumsReply : public ReplyTempl<Message::CHECKSUMS> {
+        std::vector<std::string> sums;
+    public:
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("sums", sums);
+        }
+
+        ERLENT_FIELDS
+
+        void addSum(const std::string &sum) { sums.push_back(sum); }
+        const std::vector<std::string> &getSums() const { return sums; }
+        void clear() { sums.clear(); }
+    };
+
+    // The SHA-256 digests of 'count' blocks of 'blockSize' bytes
+    // starting at 'offset' (at most MAX_BLOCKS of them and MAX_BYTES
+    // in total, the others are left out), so that copies of the blocks
+    // cached by the client can be checked without transferring them
+    // again. The last block of the file may be shorter; there are no
+    // digests for blocks beyond its end.
+    class ChecksumsRequest : public RequestWithPathnameTempl<ChecksumsReply, Message::CHECKSUMS> {
+        off_t offset;
+        uint32_t blockSize;
+        uint32_t count;
+    public:
+        static const uint32_t MAX_BLOCKS = 1024;
+        static const uint32_t MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+        static const uint32_t MAX_BYTES = 128 * 1024 * 1024;
+
+        ChecksumsRequest() { }
+        ChecksumsRequest(const char *pathname, off_t offset, uint32_t blockSize, uint32_t count)
+            : RequestWithPathnameTempl(pathname), offset(offset), blockSize(blockSize), count(count) { }
+
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("offset", offset);
+            f("blocksize", blockSize);
+            f("count", count);
+        }
+
+        ERLENT_FIELDS
+
+        void performLocally();
+        void reset() { reply.clear(); }
+    };
+
 
     class MkdirReply : public ReplyTempl<Message::MKDIR> {
     };
@@ -519,18 +825,14 @@ namespace erlent {
         void setMode(mode_t mode) { this->mode = mode; }
         mode_t getMode() const { return mode; }
 
-        void serialize(std::ostream &os) const {
-            this->RequestWithPathnameTempl::serialize(os);
-            this->UidGid::serialize(os);
-            writenum(os, mode);
-
-        }
-        void deserialize(std::istream &is) {
-            this->RequestWithPathnameTempl::deserialize(is);
-            this->UidGid::deserialize(is);
-            readnum(is, mode);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            this->UidGid::fields(f);
+            f("mode", mode);
         }
 
+        ERLENT_FIELDS
+
         void performLocally();
     };
 
@@ -565,17 +867,14 @@ namespace erlent {
             this->times[1] = times[1];
         }
 
-        void serialize(std::ostream &os) const override {
-            this->RequestWithPathname::serialize(os);
-            writetimespec(os, times[0]);
-            writetimespec(os, times[1]);
-        }
-        void deserialize(std::istream &is) override {
-            this->RequestWithPathname::deserialize(is);
-            readtimespec(is, times[0]);
-            readtimespec(is, times[1]);
+        template<typename F> void fields(F &f) {
+            this->RequestWithPathname::fields(f);
+            f("atime", times[0]);
+            f("mtime", times[1]);
         }
 
+        ERLENT_FIELDS
+
         void performLocally();
     };
 
@@ -596,21 +895,169 @@ namespace erlent {
     public:
         void init(struct statvfs *buf) { this->buf = buf; }
         struct statvfs *getStatvfsBuf() { return buf; }
-        void serialize(std::ostream &os) const override;
-        void deserialize(std::istream &is) override;
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("statvfs", *buf);
+        }
+
+        ERLENT_FIELDS
     };
 
     class StatfsRequest : public RequestWithPathnameTempl<StatfsReply, Message::STATFS> {
+        struct statvfs buf;  // for performNested()
     public:
         using RequestWithPathnameTempl::RequestWithPathnameTempl;
-        void perform(std::ostream &os);
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
+        void performLocally();
+    };
+
+
+    class HelloReply : public ReplyTempl<Message::HELLO> {
+        int version;
+        unsigned features;
+    public:
+        void setVersion(int version) { this->version = version; }
+        int getVersion() const { return version; }
+        void setFeatures(unsigned features) { this->features = features; }
+        unsigned getFeatures() const { return features; }
+        WireFormat getWireFormat() const {
+            return version >= PROTOCOL_BINARY ? BINARY : TEXT;
+        }
+
+        // switch 'ch' to the negotiated format and features
+        void configure(Channel &ch) const;
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("version", version);
+            f("features", features);
+        }
+
+        ERLENT_FIELDS
+    };
+
+    // Sent by the client as the first message (always in text format);
+    // the server answers with the highest protocol version supported by
+    // both sides and the requested features it supports, then both
+    // switch to the corresponding wire format.
+    class HelloRequest : public Request {
+        int version;
+        unsigned features;
+        HelloReply reply;
+    public:
+        HelloRequest() { }
+        HelloRequest(int version, unsigned features)
+            : version(version), features(features) { }
+
+        Message::Type getMessageType() const { return Message::HELLO; }
+        HelloReply &getReply() { return reply; }
+        int getVersion() const { return version; }
+
+        template<typename F> void fields(F &f) {
+            f("version", version);
+            f("features", features);
+        }
+
+        ERLENT_FIELDS
+
+        void perform(Channel &ch);
+        void performLocally();
+    };
+
+
+    // Sent by erlent-server without a request (with tag 0) when the
+    // attributes of paths it has leased to the client have changed.
+    class InvalidateReply : public ReplyTempl<Message::INVALIDATE> {
+        std::vector<std::string> pathnames;
+    public:
+        InvalidateReply() { setResult(0); }
+
+        template<typename F> void fields(F &f) {
+            this->Reply::fields(f);
+            f("paths", pathnames);
+        }
+
+        ERLENT_FIELDS
+
+        void addPathname(const std::string &path) { pathnames.push_back(path); }
+        const std::vector<std::string> &getPathnames() const { return pathnames; }
+    };
+
+    // Contains the replies of the requests of a COMPOUND request
+    // that have been performed.
+    class CompoundReply : public ReplyTempl<Message::COMPOUND> {
+        const std::vector<Request *> *requests;
+    public:
+        void init(const std::vector<Request *> *requests) { this->requests = requests; }
+
+        // the replies of the requests follow the result
+        void serialize(Encoder &enc) const override;
+        void deserialize(Decoder &dec) override;
+        size_t encodedSize(WireFormat format) const override;
+    };
+
+    // A sequence of requests sent in one round trip (e.g., GETATTR,
+    // OPEN and READ of a small file). The requests are performed in
+    // order until one of them fails; the result is the number of
+    // requests performed (including the failed one), the replies of
+    // the remaining requests are set to -ECANCELED.
+    // Only the last request may carry bulk data (READ or WRITE).
+    class CompoundRequest : public Request {
+        std::vector<Request *> requests;
+        bool owned;     // requests have been received, delete them with this
+        CompoundReply reply;
+
+        int performEach(std::function<int (Request &)> perform);
+    public:
+        CompoundRequest() : owned(false) { reply.init(&requests); }
+        ~CompoundRequest();
+
+        CompoundRequest(const CompoundRequest &) = delete;
+        CompoundRequest &operator=(const CompoundRequest &) = delete;
+
+        Message::Type getMessageType() const { return Message::COMPOUND; }
+        CompoundReply &getReply() { return reply; }
+
+        // 'req' must stay valid until the compound request has been processed
+        void add(Request &req) { requests.push_back(&req); }
+        size_t size() const { return requests.size(); }
+        Request &get(size_t i) { return *requests[i]; }
+
+        void serialize(Encoder &enc) const override;
+        void deserialize(Decoder &dec) override;
+        size_t encodedSize(WireFormat format) const override;
+        void print(std::ostream &os) const override;
+
+        void perform(Channel &ch);
+        void performNested(Channel &ch);
         void performLocally();
+        void receivePayload(Channel &ch);
+        const std::string &getOrderingPath() const;
+        void reset();
+        // For request processors without native support of COMPOUND:
+        // process the requests one after the other with 'rp'.
+        int processEach(RequestProcessor &rp);
+    };
+
+
+    // Free lists of request objects, one per message type, so that
+    // erlent-server does not allocate new objects for each message.
+    class RequestPool {
+    public:
+        static Request *get(Message::Type ty);
+        // reset() 'req' and keep it for reuse (or delete it)
+        static void put(Request *req);
     };
 
 
     class RequestProcessor {
     public:
         virtual int process(Request &req) = 0;
+        // whether requests on 'pathname' go to erlent-server (and their
+        // results are worth caching)
+        virtual bool isRemote(const std::string &pathname) const { return false; }
     };
 }
 
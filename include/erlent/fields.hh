@@ -0,0 +1,228 @@
+#ifndef _ERLENT_FIELDS_HH
+#define _ERLENT_FIELDS_HH
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "erlent/channel.hh"
+
+extern "C" {
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+}
+
+// Messages declare their fields once, in a member function template
+//
+//     template<typename F> void fields(F &f) { Base::fields(f); f("name", member); ... }
+//
+// which is instantiated with the visitors below to encode, decode,
+// compute the encoded size of and print the message. Fields may be
+// numbers, strings, vectors of fields, and structures with a field
+// list (a fields() member or one of the fields() functions below).
+
+namespace erlent {
+
+    template<typename F>
+    void fields(F &f, struct timespec &ts) {
+        f("sec", ts.tv_sec);
+        f("nsec", ts.tv_nsec);
+    }
+
+    template<typename F>
+    void fields(F &f, struct stat &st) {
+        f("ino", st.st_ino);
+        f("mode", st.st_mode);
+        f("nlink", st.st_nlink);
+        f("uid", st.st_uid);
+        f("gid", st.st_gid);
+        f("rdev", st.st_rdev);
+        f("size", st.st_size);
+        f("atime", st.st_atime);
+        f("mtime", st.st_mtim);
+        f("ctime", st.st_ctim);
+    }
+
+    template<typename F>
+    void fields(F &f, struct statvfs &st) {
+        f("bsize", st.f_bsize);
+        f("frsize", st.f_frsize);
+        f("blocks", st.f_blocks);
+        f("bfree", st.f_bfree);
+        f("bavail", st.f_bavail);
+        f("files", st.f_files);
+        f("ffree", st.f_ffree);
+        f("favail", st.f_favail);
+        f("fsid", st.f_fsid);
+        f("flag", st.f_flag);
+        f("namemax", st.f_namemax);
+    }
+
+    template<typename F, typename T>
+    auto fields(F &f, T &obj) -> decltype(obj.fields(f)) {
+        obj.fields(f);
+    }
+
+
+    class FieldWriter {
+        Encoder &enc;
+    public:
+        FieldWriter(Encoder &enc) : enc(enc) { }
+
+        template<typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        operator()(const char *, const T &v) { writenum(enc, v); }
+
+        void operator()(const char *, std::string &s) { writestr(enc, s); }
+
+        template<typename T>
+        void operator()(const char *name, std::vector<T> &v) {
+            // lists (of directory entries) are worth compressing
+            enc.setCompressible();
+            writenum(enc, v.size());
+            for (T &elem : v)
+                (*this)(name, elem);
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_class<T>::value>::type
+        operator()(const char *, T &v) { fields(*this, v); }
+    };
+
+    class FieldReader {
+        Decoder &dec;
+    public:
+        FieldReader(Decoder &dec) : dec(dec) { }
+
+        template<typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        operator()(const char *, T &v) { readnum(dec, v); }
+
+        void operator()(const char *, std::string &s) { readstr(dec, s); }
+
+        template<typename T>
+        void operator()(const char *name, std::vector<T> &v) {
+            size_t n;
+            readnum(dec, n);
+            // (each element takes at least one byte)
+            dec.require(n);
+            v.clear();
+            v.resize(n);
+            for (T &elem : v)
+                (*this)(name, elem);
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_class<T>::value>::type
+        operator()(const char *, T &v) { fields(*this, v); }
+    };
+
+    // computes the exact number of bytes written by FieldWriter
+    class FieldSizer {
+        WireFormat format;
+        size_t total;
+    public:
+        FieldSizer(WireFormat format) : format(format), total(0) { }
+        size_t size() const { return total; }
+
+        template<typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        operator()(const char *, const T &v) {
+            if (format == BINARY) {
+                uint64_t z = zigzag(v);
+                do {
+                    ++total;
+                    z >>= 7;
+                } while (z != 0);
+            } else
+                total += std::to_string(v).length() + 1;
+        }
+
+        void operator()(const char *name, std::string &s) {
+            (*this)(name, s.length());
+            total += s.length();
+        }
+
+        template<typename T>
+        void operator()(const char *name, std::vector<T> &v) {
+            (*this)(name, v.size());
+            for (T &elem : v)
+                (*this)(name, elem);
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_class<T>::value>::type
+        operator()(const char *, T &v) { fields(*this, v); }
+    };
+
+    // prints "name=value" pairs for debugging
+    class FieldPrinter {
+        std::ostream &os;
+    public:
+        FieldPrinter(std::ostream &os) : os(os) { }
+
+        template<typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        operator()(const char *name, const T &v) { os << ' ' << name << '=' << v; }
+
+        void operator()(const char *name, std::string &s) {
+            os << ' ' << name << "=\"" << s << '"';
+        }
+
+        template<typename T>
+        void operator()(const char *name, std::vector<T> &v) {
+            os << ' ' << name << "=[" << v.size() << " elements]";
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_class<T>::value>::type
+        operator()(const char *name, T &v) {
+            os << ' ' << name << "={";
+            fields(*this, v);
+            os << " }";
+        }
+    };
+
+
+    // Generic implementations of the Message interface for a message
+    // class M with a field list. The header (message type, tag) is
+    // written by M::writeHeader() etc. from Request or Reply.
+    template<typename M>
+    void serializeFields(const M &m, Encoder &enc) {
+        m.writeHeader(enc);
+        FieldWriter w(enc);
+        const_cast<M &>(m).fields(w);
+    }
+
+    template<typename M>
+    void deserializeFields(M &m, Decoder &dec) {
+        m.readHeader(dec);
+        FieldReader r(dec);
+        m.fields(r);
+    }
+
+    template<typename M>
+    size_t fieldsSize(const M &m, WireFormat format) {
+        FieldSizer s(format);
+        const_cast<M &>(m).fields(s);
+        return m.headerSize(format) + s.size();
+    }
+
+    template<typename M>
+    void printFields(const M &m, std::ostream &os) {
+        m.printHeader(os);
+        FieldPrinter p(os);
+        const_cast<M &>(m).fields(p);
+    }
+}
+
+// Declares the Message interface of a class with a field list.
+#define ERLENT_FIELDS                                                                  \
+    void serialize(Encoder &enc) const override { serializeFields(*this, enc); }       \
+    void deserialize(Decoder &dec) override { deserializeFields(*this, dec); }         \
+    size_t encodedSize(WireFormat format) const override { return fieldsSize(*this, format); } \
+    void print(std::ostream &os) const override { printFields(*this, os); }
+
+#endif // _ERLENT_FIELDS_HH
@@ -4,10 +4,30 @@
 #include "erlent/child.hh"
 #include "erlent/erlent.hh"
 
+#include <cstddef>
 #include <string>
 
 #include <sys/types.h>
 
-pid_t erlent_fuse(pid_t child_pid, erlent::RequestProcessor &rp);
+// When 'multithreaded' is set, FUSE calls rp.process() from several
+// threads concurrently.
+pid_t erlent_fuse(pid_t child_pid, erlent::RequestProcessor &rp, bool multithreaded = false);
+
+// Drop the attributes of 'path' leased by erlent-server (when it has
+// sent an INVALIDATE message).
+void erlent_revoke_lease(const std::string &path);
+
+// Collect small adjacent writes to open files and send them as larger
+// WRITEs (to be called before erlent_fuse()).
+void erlent_enable_write_back();
+
+// Fetch up to 'maxBytes' ahead of sequential reads of files opened
+// read-only (to be called before erlent_fuse()).
+void erlent_enable_read_ahead(size_t maxBytes);
+
+// Fetch a manifest of the tree below 'root' from erlent-server when
+// the file system is mounted, and answer lookups from it while it is
+// valid (to be called before erlent_fuse()).
+void erlent_add_manifest(const std::string &root);
 
 #endif // _ERLENT_FUSE_HH
@@ -35,14 +35,28 @@ private:
 
     std::vector<PathProp> paths;
 
+    typedef void (LocalRequestProcessor::*Handler)(Request &req);
+
+    struct TypeInfo {
+        int pathnames;      // number of pathnames in the request (0..2)
+        bool lock;          // process with the global lock held
+        Handler emulated;   // for AttrType::Emulated
+        Handler mapped;     // for AttrType::Mapped
+    };
+
+    static const TypeInfo &typeInfo(Message::Type ty);
+
 public:
+    // number of pathnames in requests of type 'ty' (0..2)
+    static int pathnameCount(Message::Type ty) { return typeInfo(ty).pathnames; }
+
     void addPathMapping(AttrType attrType, const std::string &inside, const std::string &outside);
     AttrType getAttrType(const Request &req) const;
     AttrType getAttrType(const std::string &pathname) const;
 
 private:
     const PathProp *findPathProp(const std::string &pathname) const;
-    void translatePath(Request &req) const;
+    void translatePath(Request &req, const TypeInfo &ti) const;
     std::string translatePath(const std::string &pathname) const;
 
 private:
@@ -213,7 +227,30 @@ private:
     uid_t uid2inner(uid_t uid) const { return uid == (uid_t)-1 ? uid : params->inverseLookupUID(uid); }
     gid_t gid2inner(gid_t gid) const { return gid == (gid_t)-1 ? gid : params->inverseLookupGID(gid); }
 
-    int do_process(Request &req);
+    string entryPath(const string &dir, const string &name);
+    void emu_attrs(const string &pathname, struct stat *buf);
+    void map_attrs(struct stat *buf);
+
+    void mapToInner(UidGid &ug) const;
+
+    void emu_open(Request &req);
+    void emu_chown(Request &req);
+    void emu_chmod(Request &req);
+    void emu_creat(Request &req);
+    void emu_mkdir(Request &req);
+    void emu_link(Request &req);
+    void emu_symlink(Request &req);
+    void emu_mknod(Request &req);
+    void emu_getattr(Request &req);
+    void emu_readdir(Request &req);
+    void emu_readdirplus(Request &req);
+    void emu_unlink(Request &req);
+    void emu_rmdir(Request &req);
+    void emu_rename(Request &req);
+    void map_getattr(Request &req);
+    void map_readdirplus(Request &req);
+
+    int do_process(Request &req, const TypeInfo &ti);
 public:
     void setParams(const ChildParams &params) {
         this->params = &params;
@@ -0,0 +1,102 @@
+#ifndef _ERLENT_METACACHE_HH
+#define _ERLENT_METACACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+namespace erlent {
+
+    // Told when cached attributes leased to it change (or are evicted)
+    // before the lease has ended.
+    class LeaseHolder {
+    public:
+        virtual ~LeaseHolder() { }
+        // called with the cache locked, must not block
+        virtual void revoke(const std::string &path) = 0;
+    };
+
+    // Bounded cache of lstat() results, symlink targets and directory
+    // listings for erlent-server (disabled unless enable() has been
+    // called). Every entry is backed by inotify watches on the
+    // directories it depends on, and the pending events are read
+    // before each lookup, so changes made on this host (by
+    // erlent-server itself or anyone else) are seen by the next
+    // request. Changes inotify does not report (e.g. those of other
+    // NFS clients) are picked up when an entry expires after MAX_AGE
+    // seconds.
+    class MetadataCache {
+    public:
+        static const size_t DEFAULT_MAX_ENTRIES = 16384;
+        static const int MAX_AGE = 30;
+
+        // A lookup that missed: the directories the result depends on
+        // are watched from then on, so the result can be stored after
+        // querying the file system unless they have changed meanwhile.
+        class Miss {
+        public:
+            // (only used by MetadataCache)
+            std::string key;
+            std::vector<std::string> dirs;
+            uint64_t changes;
+
+            Miss() : changes(0) { }
+            ~Miss();
+            Miss(const Miss &) = delete;
+            Miss &operator=(const Miss &) = delete;
+        };
+
+        static void enable(size_t maxEntries = DEFAULT_MAX_ENTRIES);
+        static bool isEnabled();
+
+        static bool lookupAttr(const std::string &path, int &res, struct stat &stbuf, Miss &miss);
+        static void storeAttr(Miss &miss, int res, const struct stat &stbuf);
+
+        static bool lookupLink(const std::string &path, int &res, std::string &target, Miss &miss);
+        static void storeLink(Miss &miss, int res, const std::string &target);
+
+        // a complete directory listing with the cookie (d_off) of
+        // each entry
+        static bool lookupDir(const std::string &path, int &res, std::vector<std::string> &names,
+                              std::vector<uint64_t> &cookies, Miss &miss);
+        static void storeDir(Miss &miss, int res, const std::vector<std::string> &names,
+                             const std::vector<uint64_t> &cookies);
+
+        // a directory listing together with the attributes of the
+        // entries (st_mode 0 for those that are not cached)
+        static bool lookupDirAttrs(const std::string &path, int &res, std::vector<std::string> &names,
+                                   std::vector<uint64_t> &cookies, std::vector<struct stat> &stbufs,
+                                   Miss &miss);
+        static void storeDirAttrs(Miss &miss, int res, const std::vector<std::string> &names,
+                                  const std::vector<uint64_t> &cookies,
+                                  const std::vector<struct stat> &stbufs);
+
+        // Lease the cached attributes of 'path' to 'holder' if they
+        // match 'res' and 'stbuf' (the result just sent); returns the
+        // duration of the lease in seconds (0 if not leased).
+        static unsigned leaseAttr(const std::string &path, int res, const struct stat &stbuf,
+                                  LeaseHolder *holder);
+        static void releaseLeases(LeaseHolder *holder);
+
+        // Lease a whole tree read from the file system: each directory
+        // below 'root' is passed to watchTree() before it is read, then
+        // leaseTree() leases what has been read to 'holder' unless it
+        // has changed meanwhile (returns the duration as leaseAttr()).
+        // Any later change in one of the directories revokes 'root'.
+        static bool watchTree(const std::string &root, const std::string &dir, Miss &miss);
+        static unsigned leaseTree(Miss &miss, LeaseHolder *holder);
+
+        // For handling inotify events as soon as they arrive (instead
+        // of before the next lookup): getEventFd() becomes readable
+        // then (-1 if disabled).
+        static int getEventFd();
+        static void processEvents();
+    };
+}
+
+#endif // _ERLENT_METACACHE_HH
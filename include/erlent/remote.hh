@@ -0,0 +1,147 @@
+#ifndef _ERLENT_REMOTE_HH
+#define _ERLENT_REMOTE_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "erlent/channel.hh"
+#include "erlent/erlent.hh"
+
+namespace erlent {
+
+// Forwards requests to erlent-server. With the binary protocol, any
+// number of threads may have requests outstanding at the same time:
+// each request is tagged and a receiver thread hands every reply to
+// the thread waiting for its tag. With the text protocol, requests
+// are processed one at a time.
+class RemoteRequestProcessor : public RequestProcessor
+{
+public:
+    // called with each path in an INVALIDATE message
+    typedef std::function<void (const std::string &)> InvalidationHandler;
+
+    // a request which has been sent, but whose reply may still be missing
+    struct Pending {
+        Reply *reply;
+        bool done;
+        std::condition_variable cv;
+
+        Pending(Reply *reply) : reply(reply), done(false) { }
+    };
+
+private:
+
+    // Everything the receiver thread uses. The thread shares it, so
+    // that it stays valid when the thread cannot be stopped before
+    // the RemoteRequestProcessor is destroyed.
+    struct Connection {
+        Channel ch;
+        InvalidationHandler invalidationHandler;
+
+        std::mutex m;           // protects the members below
+        std::map<uint32_t, Pending *> pending;
+        uint32_t nextTag;
+        bool closed;
+
+        Connection(int infd, int outfd) : ch(infd, outfd), nextTag(1), closed(false) { }
+        void receiveReplies();
+        void close();
+    };
+
+    std::shared_ptr<Connection> conn;
+    std::mutex textMutex;   // serializes round trips in text format
+    std::once_flag receiverStarted;
+    std::thread receiver;
+
+public:
+    RemoteRequestProcessor(int infd, int outfd);
+    ~RemoteRequestProcessor();
+
+    // use the shared ring in 'memfd' if erlent-server agrees
+    void offerSharedRing(int memfd) { conn->ch.offerSharedRing(memfd, false); }
+    // (to be set before the first request)
+    void setInvalidationHandler(const InvalidationHandler &handler) { conn->invalidationHandler = handler; }
+    void handshake();
+
+    int process(Request &req) override;
+    bool isRemote(const std::string &pathname) const override { return true; }
+
+    // process() split in two: send the request, then wait for its
+    // reply (in text format, start() waits for the reply already)
+    void start(Request &req, Pending &p);
+    int finish(Pending &p);
+};
+
+// Distributes the requests of one session over several channels to
+// erlent-server: metadata requests by a hash of their pathname (so
+// that requests on the same path are not reordered), data requests
+// in turn, and large READs are split into (at most MAX_STRIPES)
+// stripes which are transferred on all channels at the same time.
+class StripedRequestProcessor : public RequestProcessor
+{
+    std::vector<std::unique_ptr<RemoteRequestProcessor>> channels;
+    std::atomic<unsigned> nextChannel;
+
+    int processStriped(ReadRequest &req);
+
+public:
+    // READs of at least two stripes are striped
+    static const size_t STRIPE_SIZE = 128 * 1024;
+    // (the stripes of larger READs are larger)
+    static const size_t MAX_STRIPES = 16;
+
+    StripedRequestProcessor() : nextChannel(0) { }
+
+    void addChannel(int infd, int outfd);
+    // Add the channels passed by erlent-server in the environment
+    // (after the channel on stdin/stdout), and offer the shared rings
+    // passed for them.
+    void addInheritedChannels();
+    size_t getChannelCount() const { return channels.size(); }
+
+    void setInvalidationHandler(const RemoteRequestProcessor::InvalidationHandler &handler);
+    void handshake();
+
+    int process(Request &req) override;
+    bool isRemote(const std::string &pathname) const override { return true; }
+};
+
+// Sends the requests on paths chosen with addRoute(..., true) to
+// 'local' (a LocalRequestProcessor) and all others to 'remote'; the
+// longest matching prefix decides. Requests involving paths on both
+// sides (LINK, RENAME) fail with EXDEV.
+class RoutingRequestProcessor : public RequestProcessor
+{
+    RequestProcessor &local, &remote;
+    std::vector<std::pair<std::string, bool>> routes;   // longest prefix first
+
+    bool isLocal(const std::string &pathname) const;
+    // 1 if all paths of 'req' are local, 0 if all are remote, -1 otherwise
+    int sideOf(Request &req) const;
+
+public:
+    RoutingRequestProcessor(RequestProcessor &local, RequestProcessor &remote)
+        : local(local), remote(remote) { }
+
+    void addRoute(const std::string &prefix, bool isLocal);
+
+    int process(Request &req) override;
+    bool isRemote(const std::string &pathname) const override { return !isLocal(pathname); }
+};
+
+// Name of the environment variable listing the file descriptors of
+// the additional channels ("IN,OUT IN,OUT ...").
+extern const char *const CHANNELS_ENV;
+// Name of the environment variable listing the memfds of the shared
+// rings of all channels ("FD FD ...", stdin/stdout first).
+extern const char *const RINGS_ENV;
+
+}
+
+#endif // _ERLENT_REMOTE_HH
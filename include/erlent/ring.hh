@@ -0,0 +1,64 @@
+#ifndef _ERLENT_RING_HH
+#define _ERLENT_RING_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace erlent {
+
+    // A pair of single-producer/single-consumer byte rings in a memfd
+    // shared by erlent-server and its client, one for each direction.
+    // Messages (including their bulk data) are copied into the ring by
+    // the sender and out of it by the receiver; a side only sleeps (on
+    // a futex in the shared memory) when its ring is empty or full,
+    // and is only woken when it does.
+    //
+    // The peer is considered gone when the ring has been closed or
+    // when 'peerfd' (the pipe or socket the rings have been negotiated
+    // on) reports a hangup.
+    class SharedRing {
+    public:
+        static const size_t RING_SIZE = 2 * 1024 * 1024;
+
+        // create and initialize the shared memory (-1 on errors)
+        static int create();
+
+        // 'creator' tells which side of the rings to use
+        SharedRing(int memfd, bool creator);
+        ~SharedRing();
+
+        SharedRing(const SharedRing &) = delete;
+        SharedRing &operator=(const SharedRing &) = delete;
+
+        bool isMapped() const { return base != nullptr; }
+
+        // receive between 1 and 'len' bytes (throws EofException)
+        size_t read(char *data, size_t len, int peerfd);
+        // send all of 'data' (throws EofException)
+        void write(const char *data, size_t len, int peerfd);
+        // make both sides' read() and write() fail
+        void close();
+
+    private:
+        struct Ring {
+            alignas(64) std::atomic<uint64_t> head;     // bytes written
+            alignas(64) std::atomic<uint64_t> tail;     // bytes read
+            alignas(64) std::atomic<uint32_t> readerWaiting;
+            std::atomic<uint32_t> writerWaiting;
+            std::atomic<uint32_t> closed;
+        };
+
+        static const size_t HEADER_SIZE = 4096;
+        static const size_t MAP_SIZE = HEADER_SIZE + 2 * RING_SIZE;
+
+        char *base;
+        Ring *in, *out;
+        char *inData, *outData;
+
+        void wait(std::atomic<uint32_t> &waiting, const Ring &ring, int peerfd);
+        void wake(std::atomic<uint32_t> &waiting);
+    };
+}
+
+#endif // _ERLENT_RING_HH
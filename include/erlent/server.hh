@@ -0,0 +1,126 @@
+#ifndef _ERLENT_SERVER_HH
+#define _ERLENT_SERVER_HH
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "erlent/channel.hh"
+#include "erlent/erlent.hh"
+#include "erlent/metacache.hh"
+
+namespace erlent {
+
+class Server;
+
+// Worker threads performing the requests of one or more servers. The
+// requests of a server are queued in lanes by their ordering path;
+// each lane is worked off one request at a time. Servers with pending
+// requests take turns, one request each, so that a busy client cannot
+// hold up the others.
+class WorkerPool
+{
+    std::mutex m;               // protects the members below and the
+                                // lanes of the servers
+    std::condition_variable cv;
+    std::condition_variable idle;
+    std::deque<Server *> ready; // servers with a lane to work on
+    bool stopping;
+    std::vector<std::thread> threads;
+
+    void work();
+    void schedule(Server *server);
+
+public:
+    explicit WorkerPool(unsigned nworkers);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    unsigned size() const { return threads.size(); }
+
+    void push(Server *server, Request *req);
+    // wait until all requests of 'server' have been performed
+    void drain(Server *server);
+};
+
+// Performs the requests received from a channel. Without workers,
+// each request is performed (and its reply sent) before the next one
+// is received. With workers, the receiving thread only decodes the
+// requests (reading WRITE data into memory) and hands them to the
+// workers; a writer thread sends the replies as they are finished.
+// Requests with the same ordering path are performed in the order of
+// their arrival. The workers may be shared with other servers.
+//
+// Replies can only be sent out of order in binary format, requests
+// received in text format are performed by the receiving thread.
+//
+// When leases have been negotiated, a pusher thread sends INVALIDATE
+// messages for the leased attributes that have changed.
+class Server : public LeaseHolder
+{
+    friend class WorkerPool;
+
+    // FIFO of requests, terminated by a nullptr
+    class Queue {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<Request *> requests;
+    public:
+        void push(Request *req);
+        Request *pop();
+    };
+
+    struct Lane {
+        std::deque<Request *> requests;
+        bool busy = false;
+    };
+
+    Channel &ch;
+    std::unique_ptr<WorkerPool> ownPool;
+    WorkerPool *pool;
+    // the members below are protected by the mutex of the pool
+    std::vector<Lane> lanes;
+    size_t nextLane;
+    unsigned pending;           // requests queued or being performed
+    bool scheduled;             // in the ready queue of the pool
+
+    Queue replyQueue;
+    std::thread writer;
+
+    std::mutex revokedMutex;    // protects the members below
+    std::vector<std::string> revoked;
+    bool stopPushing;
+    int wakeFd;                 // eventfd waking the pusher
+    std::thread pusher;
+
+    void performInline(Request *req);
+    void dispatch(Request *req);
+    int runnableLane();
+    void writeReplies();
+    void startLeases();
+    void pushRevocations();
+    void wakePusher();
+
+public:
+    Server(Channel &ch, unsigned nworkers = 0);
+    // use the workers of 'pool' (if not nullptr)
+    Server(Channel &ch, WorkerPool *pool);
+    ~Server();
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    void revoke(const std::string &path) override;
+
+    // process requests until the channel is closed
+    void run();
+};
+
+}
+
+#endif // _ERLENT_SERVER_HH
@@ -0,0 +1,16 @@
+#ifndef _ERLENT_SHA256_HH
+#define _ERLENT_SHA256_HH
+
+#include <cstddef>
+#include <string>
+
+namespace erlent {
+
+    static const size_t SHA256_SIZE = 32;
+
+    // The SHA-256 digest (FIPS 180-4) of 'len' bytes at 'data', as
+    // SHA256_SIZE raw bytes.
+    std::string sha256(const void *data, size_t len);
+}
+
+#endif // _ERLENT_SHA256_HH
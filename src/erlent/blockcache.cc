@@ -0,0 +1,611 @@
+#include "erlent/blockcache.hh"
+#include "erlent/erlent.hh"
+#include "erlent/sha256.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+// A cached file is stored as NAME.data (the blocks at their offsets)
+// and NAME.map (its path, attributes and which blocks are present),
+// where NAME is derived from the path.
+class BlockCache::File {
+public:
+    string path;
+    string name;
+    off_t size;                 // the attributes of the cached version
+    struct timespec mtime;
+    struct timespec ctime;
+    ino_t ino;
+    vector<bool> present;       // per block
+    vector<bool> unverified;    // per block kept from an older version
+    uint64_t bytes;             // in the present and unverified blocks
+    int fd;                     // of the data file while open
+    unsigned refs;
+    bool valid;                 // false if the file may have changed
+    bool discarded;             // to be removed when closed
+    bool dirty;                 // 'present' differs from the map file
+    list<string>::iterator lru;
+};
+
+static const char MAP_MAGIC[] = "erlent-blockcache 2";
+
+static mutex cacheMutex;
+static string cacheDir;
+static uint64_t maxBytes = 0;       // 0: disabled
+static uint64_t totalBytes = 0;
+static map<string, BlockCache::File> files;     // by path
+static list<string> lru;            // paths, most recently used first
+static unordered_map<string, string> names;     // name -> path
+
+
+static size_t blocksOf(off_t size)
+{
+    return (size + BlockCache::BLOCK_SIZE - 1) / BlockCache::BLOCK_SIZE;
+}
+
+static size_t blockBytes(off_t size, size_t block)
+{
+    return min((off_t)BlockCache::BLOCK_SIZE, size - (off_t)(block * BlockCache::BLOCK_SIZE));
+}
+
+static size_t blockBytes(const BlockCache::File &f, size_t block)
+{
+    return blockBytes(f.size, block);
+}
+
+static string nameOf(const string &path)
+{
+    ostringstream os;
+    os << hex << setw(16) << setfill('0') << (uint64_t)hash<string>()(path);
+    return os.str();
+}
+
+static string mapPath(const string &name)
+{
+    return cacheDir + "/" + name + ".map";
+}
+
+static string dataPath(const string &name)
+{
+    return cacheDir + "/" + name + ".data";
+}
+
+static bool pwriteAll(int fd, const char *data, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// The map file is replaced atomically, after the blocks it lists have
+// been written.
+static bool writeMap(BlockCache::File &f)
+{
+    string bits((f.present.size() + 7) / 8, '\0');
+    for (size_t i=0; i<f.present.size(); ++i) {
+        if (f.present[i])
+            bits[i / 8] |= 1 << (i % 8);
+    }
+    ostringstream os;
+    os << MAP_MAGIC << '\n' << f.size << ' ' << f.mtime.tv_sec << ' ' << f.mtime.tv_nsec
+       << ' ' << f.ctime.tv_sec << ' ' << f.ctime.tv_nsec << ' ' << f.ino << ' ' << f.path.size() << '\n'
+       << f.path << '\n' << bits;
+    string s = os.str();
+
+    string tmp = mapPath(f.name) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return false;
+    bool ok = pwriteAll(fd, s.data(), s.size(), 0);
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), mapPath(f.name).c_str()) == -1) {
+        int err = errno;
+        dbg() << "Cannot write block cache map for '" << f.path << "': " << strerror(err) << endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+    f.dirty = false;
+    return true;
+}
+
+static bool readMap(const string &name, BlockCache::File &f)
+{
+    int fd = ::open(mapPath(name).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    string s;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        s.append(buf, n);
+    ::close(fd);
+
+    istringstream is(s);
+    string magic;
+    size_t pathlen;
+    if (!getline(is, magic) || magic != MAP_MAGIC
+        || !(is >> f.size >> f.mtime.tv_sec >> f.mtime.tv_nsec >> f.ctime.tv_sec >> f.ctime.tv_nsec
+             >> f.ino >> pathlen)
+        || f.size < 0 || is.get() != '\n')
+        return false;
+    f.path.resize(pathlen);
+    if (!is.read(&f.path[0], pathlen) || is.get() != '\n')
+        return false;
+    size_t nblocks = blocksOf(f.size);
+    string bits((nblocks + 7) / 8, '\0');
+    if (!is.read(&bits[0], bits.size()) || is.peek() != EOF)
+        return false;
+
+    f.name = name;
+    f.present.assign(nblocks, false);
+    f.unverified.clear();
+    f.bytes = 0;
+    for (size_t i=0; i<nblocks; ++i) {
+        if (bits[i / 8] & (1 << (i % 8))) {
+            f.present[i] = true;
+            f.bytes += blockBytes(f, i);
+        }
+    }
+    f.fd = -1;
+    f.refs = 0;
+    f.valid = true;
+    f.discarded = false;
+    f.dirty = false;
+    return true;
+}
+
+static void touch(BlockCache::File &f)
+{
+    lru.splice(lru.begin(), lru, f.lru);
+}
+
+// returns the entry following it in 'lru'
+static list<string>::iterator removeEntry(map<string, BlockCache::File>::iterator it)
+{
+    BlockCache::File &f = it->second;
+    dbg() << "Removing '" << f.path << "' from the block cache" << endl;
+    if (f.fd != -1)
+        ::close(f.fd);
+    unlink(mapPath(f.name).c_str());
+    unlink(dataPath(f.name).c_str());
+    totalBytes -= f.bytes;
+    names.erase(f.name);
+    auto next = lru.erase(f.lru);
+    files.erase(it);
+    return next;
+}
+
+// Remove the least recently used files (except open ones) until the
+// cache is not larger than maxBytes.
+static void evict()
+{
+    for (auto it = lru.end(); totalBytes > maxBytes && it != lru.begin(); ) {
+        auto f = files.find(*--it);
+        if (f->second.refs == 0)
+            it = removeEntry(f);
+    }
+}
+
+static void load()
+{
+    DIR *d = opendir(cacheDir.c_str());
+    if (d == NULL)
+        return;
+    vector<string> dirents;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        dirents.push_back(de->d_name);
+    closedir(d);
+
+    vector<pair<time_t, string>> used;
+    for (const string &dent : dirents) {
+        if (dent.size() <= 4 || dent.compare(dent.size() - 4, 4, ".map") != 0)
+            continue;
+        string name = dent.substr(0, dent.size() - 4);
+        BlockCache::File f;
+        struct stat mapst, datast;
+        if (!readMap(name, f) || files.count(f.path) != 0 || nameOf(f.path) != name
+            || stat(mapPath(name).c_str(), &mapst) == -1 || stat(dataPath(name).c_str(), &datast) == -1) {
+            unlink(mapPath(name).c_str());
+            continue;
+        }
+        // blocks beyond the end of the data file were not written
+        // completely
+        for (size_t i=0; i<f.present.size(); ++i) {
+            if (f.present[i] && (off_t)(i * BlockCache::BLOCK_SIZE + blockBytes(f, i)) > datast.st_size) {
+                f.present[i] = false;
+                f.bytes -= blockBytes(f, i);
+                f.dirty = true;
+            }
+        }
+        totalBytes += f.bytes;
+        names[name] = f.path;
+        used.push_back(make_pair(mapst.st_mtime, f.path));
+        files[f.path] = f;
+    }
+
+    sort(used.begin(), used.end());
+    for (auto &u : used) {
+        lru.push_front(u.second);
+        files[u.second].lru = lru.begin();
+    }
+
+    // data files without map and left over temporary files
+    for (const string &dent : dirents) {
+        size_t dot = dent.find('.');
+        if (dot == string::npos || dent == "lock" || dent.compare(dot, string::npos, ".map") == 0)
+            continue;
+        if (dent.compare(dot, string::npos, ".data") != 0 || names.count(dent.substr(0, dot)) == 0)
+            unlink((cacheDir + "/" + dent).c_str());
+    }
+    dbg() << "Block cache '" << cacheDir << "': " << files.size() << " files, "
+          << totalBytes << " bytes" << endl;
+}
+
+bool BlockCache::enable(const string &dir, uint64_t max)
+{
+    if (max == 0)
+        return false;
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+        int err = errno;
+        cerr << "Cannot create block cache '" << dir << "': " << strerror(err) << endl;
+        return false;
+    }
+    // held until this process (and its children) exit
+    string lockPath = dir + "/lock";
+    int fd = ::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        int err = errno;
+        cerr << "Cannot use block cache '" << dir << "': "
+             << (err == EWOULDBLOCK ? "in use by another session" : strerror(err)) << endl;
+        if (fd != -1)
+            ::close(fd);
+        return false;
+    }
+
+    lock_guard<mutex> lock(cacheMutex);
+    cacheDir = dir;
+    maxBytes = max;
+    load();
+    evict();
+    return true;
+}
+
+bool BlockCache::isEnabled()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    return maxBytes != 0;
+}
+
+static bool openData(BlockCache::File &f, bool create)
+{
+    f.fd = ::open(dataPath(f.name).c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (f.fd == -1) {
+        int err = errno;
+        dbg() << "Cannot open block cache data for '" << f.path << "': " << strerror(err) << endl;
+        return false;
+    }
+    return true;
+}
+
+// A file is taken to be unchanged while its size, inode number and
+// change and modification times (to the nanosecond) stay the same.
+static bool isVersion(const BlockCache::File &f, const struct stat &stbuf)
+{
+    return f.size == stbuf.st_size && f.ino == stbuf.st_ino
+        && f.mtime.tv_sec == stbuf.st_mtim.tv_sec && f.mtime.tv_nsec == stbuf.st_mtim.tv_nsec
+        && f.ctime.tv_sec == stbuf.st_ctim.tv_sec && f.ctime.tv_nsec == stbuf.st_ctim.tv_nsec;
+}
+
+static void setVersion(BlockCache::File &f, const struct stat &stbuf)
+{
+    f.size = stbuf.st_size;
+    f.mtime = stbuf.st_mtim;
+    f.ctime = stbuf.st_ctim;
+    f.ino = stbuf.st_ino;
+}
+
+// The file has changed: keep the blocks of the old version that have
+// the same length in the new one, as unverified blocks (they count
+// towards the size of the cache until verify() drops them). They are
+// not written to the map file, so they are dropped when the session
+// ends before they have been verified.
+static bool keepBlocks(BlockCache::File &f, const struct stat &stbuf)
+{
+    vector<bool> kept(blocksOf(stbuf.st_size), false);
+    uint64_t keptBytes = 0;
+    for (size_t b=0; b<min(f.present.size(), kept.size()); ++b) {
+        bool old = f.present[b] || (b < f.unverified.size() && f.unverified[b]);
+        if (old && blockBytes(f, b) == blockBytes(stbuf.st_size, b)) {
+            kept[b] = true;
+            keptBytes += blockBytes(stbuf.st_size, b);
+        }
+    }
+    if (keptBytes == 0 || !openData(f, false))
+        return false;
+    if (stbuf.st_size < f.size && ftruncate(f.fd, stbuf.st_size) == -1) {
+        int err = errno;
+        dbg() << "Cannot truncate block cache data for '" << f.path << "': " << strerror(err) << endl;
+        return false;
+    }
+    totalBytes = totalBytes - f.bytes + keptBytes;
+    setVersion(f, stbuf);
+    f.present.assign(kept.size(), false);
+    f.unverified = kept;
+    f.bytes = keptBytes;
+    f.refs = 1;
+    f.valid = true;
+    if (!writeMap(f))
+        return false;
+    touch(f);
+    return true;
+}
+
+BlockCache::File *BlockCache::open(const string &path, const struct stat &stbuf)
+{
+    if (!S_ISREG(stbuf.st_mode))
+        return nullptr;
+    lock_guard<mutex> lock(cacheMutex);
+    if (maxBytes == 0)
+        return nullptr;
+
+    auto it = files.find(path);
+    if (it != files.end()) {
+        File &f = it->second;
+        bool current = !f.discarded && isVersion(f, stbuf);
+        if (f.refs > 0) {
+            // (cannot be replaced while in use)
+            if (!current || !f.valid)
+                return nullptr;
+            ++f.refs;
+            touch(f);
+            return &f;
+        }
+        if (current && openData(f, false)) {
+            f.refs = 1;
+            f.valid = true;
+            touch(f);
+            return &f;
+        }
+        if (!current && !f.discarded && keepBlocks(f, stbuf))
+            return &f;
+        removeEntry(it);
+    }
+
+    string name = nameOf(path);
+    auto n = names.find(name);
+    if (n != names.end()) {
+        auto other = files.find(n->second);
+        if (other->second.refs > 0)
+            return nullptr;
+        removeEntry(other);
+    }
+
+    File &f = files[path];
+    f.path = path;
+    f.name = name;
+    setVersion(f, stbuf);
+    f.present.assign(blocksOf(f.size), false);
+    f.unverified.clear();
+    f.bytes = 0;
+    f.fd = -1;
+    f.refs = 1;
+    f.valid = true;
+    f.discarded = false;
+    f.dirty = false;
+    names[name] = path;
+    lru.push_front(path);
+    f.lru = lru.begin();
+    if (!writeMap(f) || !openData(f, true)) {
+        removeEntry(files.find(path));
+        return nullptr;
+    }
+    return &f;
+}
+
+void BlockCache::close(File *file)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    if (--file->refs > 0)
+        return;
+    if (file->discarded) {
+        removeEntry(files.find(file->path));
+        return;
+    }
+    if (file->dirty) {
+        fdatasync(file->fd);
+        writeMap(*file);
+    } else {
+        // for the order of eviction in the next session
+        utimensat(AT_FDCWD, mapPath(file->name).c_str(), NULL, 0);
+    }
+    ::close(file->fd);
+    file->fd = -1;
+    evict();
+}
+
+ssize_t BlockCache::read(File *file, char *buf, size_t size, off_t offset)
+{
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        if (!file->valid)
+            return -1;
+        if (offset >= file->size)
+            return 0;
+        size = min(size, (size_t)(file->size - offset));
+        if (size == 0)
+            return 0;
+        for (size_t b = offset / BLOCK_SIZE; b <= (offset + size - 1) / BLOCK_SIZE; ++b) {
+            if (!file->present[b])
+                return -1;
+        }
+    }
+    ssize_t n = pread(file->fd, buf, size, offset);
+    return n == (ssize_t)size ? n : -1;
+}
+
+void BlockCache::store(File *file, const char *data, size_t len, ssize_t res, off_t offset)
+{
+    size_t first = offset / BLOCK_SIZE, count;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        if (!file->valid)
+            return;
+        size_t expected = offset >= file->size ? 0 : min(len, (size_t)(file->size - offset));
+        if (res != (ssize_t)expected) {
+            // the file has changed since it was opened
+            dbg() << "'" << file->path << "' has changed, not caching it" << endl;
+            file->valid = false;
+            return;
+        }
+        // (only whole blocks, or the last block of the file, are read)
+        count = blocksOf(res);
+    }
+    if (count == 0)
+        return;
+    if (!pwriteAll(file->fd, data, res, offset)) {
+        int err = errno;
+        dbg() << "Cannot write to block cache: " << strerror(err) << endl;
+        return;
+    }
+
+    lock_guard<mutex> lock(cacheMutex);
+    for (size_t b = first; b < first + count; ++b) {
+        if (b < file->unverified.size() && file->unverified[b]) {
+            // (counted already)
+            file->unverified[b] = false;
+            file->present[b] = true;
+            file->dirty = true;
+        } else if (!file->present[b]) {
+            file->present[b] = true;
+            file->bytes += blockBytes(*file, b);
+            totalBytes += blockBytes(*file, b);
+            file->dirty = true;
+        }
+    }
+    evict();
+}
+
+size_t BlockCache::unverified(File *file, off_t offset, size_t size, size_t max, off_t &runOffset)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    const vector<bool> &u = file->unverified;
+    if (!file->valid || size == 0)
+        return 0;
+    size_t b = offset / BLOCK_SIZE, last = (offset + size - 1) / BLOCK_SIZE;
+    while (b <= last && b < u.size() && !u[b])
+        ++b;
+    if (b > last || b >= u.size())
+        return 0;
+    size_t end = b;
+    while (end < u.size() && end - b < max && u[end])
+        ++end;
+    runOffset = b * BLOCK_SIZE;
+    return end - b;
+}
+
+void BlockCache::verify(File *file, off_t offset, size_t count, const vector<string> &sums)
+{
+    size_t first = offset / BLOCK_SIZE;
+    vector<size_t> blocks;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        if (!file->valid)
+            return;
+        for (size_t b = first; b < first + count && b < file->unverified.size(); ++b) {
+            if (file->unverified[b])
+                blocks.push_back(b);
+        }
+    }
+    // (the size does not change while the file is open)
+    vector<size_t> matching;
+    Buffer data(BLOCK_SIZE);
+    for (size_t b : blocks) {
+        size_t len = blockBytes(*file, b);
+        if (b - first < sums.size()
+            && pread(file->fd, data.get(), len, b * BLOCK_SIZE) == (ssize_t)len
+            && sha256(data.get(), len) == sums[b - first])
+            matching.push_back(b);
+    }
+
+    lock_guard<mutex> lock(cacheMutex);
+    size_t m = 0;
+    for (size_t b : blocks) {
+        // (unless store() has replaced it meanwhile)
+        if (!file->unverified[b])
+            continue;
+        file->unverified[b] = false;
+        if (m < matching.size() && matching[m] == b && file->valid) {
+            file->present[b] = true;
+            file->dirty = true;
+        } else {
+            file->bytes -= blockBytes(*file, b);
+            totalBytes -= blockBytes(*file, b);
+        }
+        while (m < matching.size() && matching[m] <= b)
+            ++m;
+    }
+    dbg() << "'" << file->path << "': " << matching.size() << " of " << blocks.size()
+          << " blocks of the old version verified" << endl;
+    evict();
+}
+
+void BlockCache::invalidate(const string &path)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    auto it = files.find(path);
+    if (it != files.end())
+        it->second.valid = false;
+}
+
+static void discardEntry(map<string, BlockCache::File>::iterator it)
+{
+    BlockCache::File &f = it->second;
+    if (f.refs > 0) {
+        f.valid = false;
+        f.discarded = true;
+    } else {
+        removeEntry(it);
+    }
+}
+
+void BlockCache::discard(const string &path)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    auto it = files.find(path);
+    if (it != files.end())
+        discardEntry(it);
+    string prefix = path == "/" ? path : path + "/";
+    it = files.lower_bound(prefix);
+    while (it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+        discardEntry(it++);
+}
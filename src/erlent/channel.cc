@@ -0,0 +1,817 @@
+#include "erlent/buffer.hh"
+#include "erlent/channel.hh"
+#include "erlent/erlent.hh"
+#include "erlent/ring.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+static const size_t INITIAL_BUFSIZE = 64 * 1024;
+
+thread_local string Encoder::spareHeader;
+
+Encoder::Encoder(WireFormat format)
+    : format(format), payload(nullptr), payloadLen(0),
+      payloadStable(false), payloadPipe(-1), compressible(false)
+{
+    // reuse the header buffer of the last message of this thread
+    header.swap(spareHeader);
+    // reserve room for the lengths, filled in by Channel::send()
+    if (format == BINARY)
+        header.append(2 * sizeof(uint32_t), '\0');
+}
+
+Encoder::~Encoder()
+{
+    header.clear();
+    spareHeader.swap(header);
+}
+
+// unsigned LEB128: 7 bits per byte, high bit set on all but the last byte
+void Encoder::writevarint(uint64_t value)
+{
+    char buf[10];
+    int n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (char)value;
+    write(buf, n);
+}
+
+void Encoder::setPayload(const char *data, size_t len, bool stable)
+{
+    payload = data;
+    payloadLen = len;
+    payloadStable = stable;
+    payloadPipe = -1;
+}
+
+void Encoder::setPayloadPipe(int pipefd, size_t len)
+{
+    payload = nullptr;
+    payloadLen = len;
+    payloadStable = false;
+    payloadPipe = pipefd;
+}
+
+
+Decoder::Decoder(Channel &ch)
+    : ch(ch)
+{
+    ch.beginFrame();
+}
+
+Decoder::~Decoder()
+{
+    ch.endFrame();
+}
+
+WireFormat Decoder::getFormat() const
+{
+    return ch.getFormat();
+}
+
+char Decoder::getc()
+{
+    return ch.getc();
+}
+
+void Decoder::read(char *data, size_t len)
+{
+    ch.read(data, len);
+}
+
+uint64_t Decoder::readvarint()
+{
+    uint64_t value = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        c = (unsigned char)ch.getc();
+        if (shift < 64)
+            value |= (uint64_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return value;
+}
+
+void Decoder::require(size_t len)
+{
+    ch.require(len);
+}
+
+void Decoder::beginPayload(size_t len)
+{
+    ch.beginPayload(len);
+}
+
+void Decoder::readPayload(char *data, size_t len)
+{
+    ch.beginPayload(len);
+    ch.readPayload(data, len);
+}
+
+int Decoder::receiveFd()
+{
+    return ch.receiveFd();
+}
+
+
+Channel::Channel(int infd, int outfd)
+    : infd(infd), outfd(outfd), format(TEXT),
+      bufsize(INITIAL_BUFSIZE), inpos(0), inend(0),
+      frameLeft(SIZE_MAX), payloadLeft(0),
+      compression(false), ratio(0.0), skipCompression(0), inflater(nullptr),
+      fdPassing(false), ringFd(-1), ringCreator(false), ring(nullptr),
+      leaseHolder(nullptr)
+{
+    inbuf = BufferPool::get(bufsize);
+    bufsize = BufferPool::capacity(bufsize);
+}
+
+Channel::~Channel()
+{
+    BufferPool::put(inbuf, bufsize);
+    if (inflater != nullptr) {
+        inflateEnd(inflater);
+        delete inflater;
+    }
+    for (int fd : receivedFds)
+        close(fd);
+    delete ring;
+    if (ringFd != -1)
+        close(ringFd);
+}
+
+void Channel::setCompression(bool on)
+{
+    compression = on && format == BINARY;
+}
+
+static bool isUnixSocketFd(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, (struct sockaddr *)&addr, &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+bool Channel::isUnixSocket() const
+{
+    return isUnixSocketFd(infd) && isUnixSocketFd(outfd);
+}
+
+void Channel::setFdPassing(bool on)
+{
+    fdPassing = on && format == BINARY && isUnixSocket();
+}
+
+void Channel::offerSharedRing(int memfd, bool creator)
+{
+    if (ringFd != -1)
+        close(ringFd);
+    ringFd = memfd;
+    ringCreator = creator;
+}
+
+void Channel::setSharedRing(bool on)
+{
+    if (!on || ringFd == -1 || format != BINARY || ring != nullptr)
+        return;
+    ring = new SharedRing(ringFd, ringCreator);
+    if (!ring->isMapped()) {
+        cerr << "Could not map the shared ring, exiting." << endl;
+        exit(1);
+    }
+}
+
+bool Channel::interrupt()
+{
+    if (ring != nullptr) {
+        ring->close();
+        return true;
+    }
+    return isUnixSocket() && ::shutdown(infd, SHUT_RDWR) == 0;
+}
+
+int Channel::receiveFd()
+{
+    if (receivedFds.empty())
+        return -1;
+    int fd = receivedFds.front();
+    receivedFds.pop_front();
+    return fd;
+}
+
+// A plain read() would discard passed file descriptors, so all input
+// is received with recvmsg() when they are expected.
+ssize_t Channel::readSome(char *data, size_t len)
+{
+    if (ring != nullptr)
+        return ring->read(data, len, infd);
+    if (!fdPassing)
+        return ::read(infd, data, len);
+
+    static const size_t MAX_FDS = 16;
+    char cbuf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t res = recvmsg(infd, &msg, MSG_CMSG_CLOEXEC);
+    if (res == -1)
+        return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i=0; i<n; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            receivedFds.push_back(fd);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+        fprintf(stderr, "Too many file descriptors passed, some have been lost.\n");
+    return res;
+}
+
+// Make sure that at least n bytes are buffered. Each read() asks for
+// as much data as fits into the buffer, so usually a complete message
+// (or several of them) is read at once.
+void Channel::fill(size_t n)
+{
+    if (inpos == inend)
+        inpos = inend = 0;
+    while (inend - inpos < n) {
+        if (bufsize - inpos < n) {
+            memmove(inbuf, inbuf + inpos, inend - inpos);
+            inend -= inpos;
+            inpos = 0;
+            if (bufsize < n) {
+                char *newbuf = BufferPool::get(n);
+                memcpy(newbuf, inbuf, inend);
+                BufferPool::put(inbuf, bufsize);
+                inbuf = newbuf;
+                bufsize = BufferPool::capacity(n);
+            }
+        }
+        ssize_t res = readSome(inbuf + inend, bufsize - inend);
+        if (res == 0) {
+            dbg() << "End of input." << endl;
+            throw EofException();
+        } else if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            throw EofException();
+        }
+        inend += res;
+    }
+}
+
+void Channel::beginFrame()
+{
+    // the previous message's payload may not have been consumed
+    skipPayload();
+    if (format != BINARY) {
+        frameLeft = SIZE_MAX;
+        return;
+    }
+    uint32_t len[2];
+    fill(sizeof(len));
+    memcpy(len, inbuf + inpos, sizeof(len));
+    inpos += sizeof(len);
+    len[0] = ntohl(len[0]);
+    len[1] = ntohl(len[1]);
+    if (len[0] & COMPRESSED_FRAME) {
+        inflateFrame(len[0] & ~COMPRESSED_FRAME, len[1]);
+        return;
+    }
+    frameLeft = len[0];
+    fill(frameLeft);
+    payloadLeft = len[1];
+}
+
+// Replace the compressed frame in the input buffer by its header and
+// payload, so that it can be decoded like an uncompressed frame.
+void Channel::inflateFrame(size_t clen, size_t plen)
+{
+    uint32_t hlen;
+    fill(sizeof(hlen) + clen);
+    memcpy(&hlen, inbuf + inpos, sizeof(hlen));
+    hlen = ntohl(hlen);
+    const char *zdata = inbuf + inpos + sizeof(hlen);
+    size_t rest = inend - inpos - sizeof(hlen) - clen;
+
+    size_t newsize = max(bufsize, hlen + plen + rest);
+    char *newbuf = BufferPool::get(newsize);
+
+    if (inflater == nullptr) {
+        inflater = new z_stream;
+        memset(inflater, 0, sizeof(*inflater));
+        if (inflateInit(inflater) != Z_OK) {
+            cerr << "Could not initialize zlib, exiting." << endl;
+            exit(1);
+        }
+    } else
+        inflateReset(inflater);
+    inflater->next_in   = (Bytef *)zdata;
+    inflater->avail_in  = clen;
+    inflater->next_out  = (Bytef *)newbuf;
+    inflater->avail_out = hlen + plen;
+    int res = inflate(inflater, Z_FINISH);
+    if (res != Z_STREAM_END || inflater->avail_out != 0) {
+        fprintf(stderr, "Corrupt compressed message (zlib result %d)\n", res);
+        throw EofException();
+    }
+
+    memcpy(newbuf + hlen + plen, zdata + clen, rest);
+    BufferPool::put(inbuf, bufsize);
+    inbuf = newbuf;
+    bufsize = BufferPool::capacity(newsize);
+    inpos = 0;
+    inend = hlen + plen + rest;
+    frameLeft = hlen;
+    payloadLeft = plen;
+}
+
+void Channel::endFrame()
+{
+    if (format == BINARY && frameLeft > 0) {
+        dbg() << "Skipping " << frameLeft << " unread bytes of message." << endl;
+        inpos += frameLeft;
+        frameLeft = 0;
+    }
+}
+
+void Channel::beginPayload(size_t len)
+{
+    endFrame();
+    if (format == BINARY) {
+        if (len != payloadLeft) {
+            fprintf(stderr, "Payload of %zu bytes expected, message has %zu\n",
+                    len, payloadLeft);
+            throw EofException();
+        }
+    } else
+        payloadLeft = len;
+}
+
+void Channel::require(size_t n)
+{
+    if (format == BINARY && n > frameLeft) {
+        fprintf(stderr, "Message truncated (%zu bytes missing)\n", n - frameLeft);
+        throw EofException();
+    }
+}
+
+void Channel::consume(size_t n)
+{
+    require(n);
+    if (format == BINARY)
+        frameLeft -= n;
+}
+
+char Channel::getc()
+{
+    consume(1);
+    if (inpos == inend)
+        fill(1);
+    return inbuf[inpos++];
+}
+
+void Channel::read(char *data, size_t len)
+{
+    consume(len);
+    size_t avail = inend - inpos;
+    if (avail >= len) {
+        memcpy(data, inbuf + inpos, len);
+        inpos += len;
+    } else
+        readDirect(data, len);
+}
+
+// Take what is buffered, read the rest directly into 'data'.
+void Channel::readDirect(char *data, size_t len)
+{
+    size_t done = min(len, inend - inpos);
+    memcpy(data, inbuf + inpos, done);
+    inpos += done;
+    while (done < len) {
+        ssize_t res = readSome(data + done, len - done);
+        if (res == 0) {
+            dbg() << "End of input." << endl;
+            throw EofException();
+        } else if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            throw EofException();
+        }
+        done += res;
+    }
+}
+
+void Channel::readPayload(char *data, size_t len)
+{
+    if (len > payloadLeft) {
+        fprintf(stderr, "Payload too short (%zu bytes missing)\n", len - payloadLeft);
+        throw EofException();
+    }
+    readDirect(data, len);
+    payloadLeft -= len;
+}
+
+ssize_t Channel::splicePayload(int fd, off_t offset, size_t len)
+{
+    if (len > payloadLeft) {
+        fprintf(stderr, "Payload too short (%zu bytes missing)\n", len - payloadLeft);
+        throw EofException();
+    }
+    int err = 0;
+    size_t done = 0;
+
+    // write the part that has been buffered already
+    size_t buffered = min(len, inend - inpos);
+    while (done < buffered && err == 0) {
+        ssize_t res = pwrite(fd, inbuf + inpos + done, buffered - done, offset + done);
+        if (res == -1)
+            err = errno;
+        else
+            done += res;
+    }
+    inpos += buffered;
+    payloadLeft -= buffered;
+
+    // move the rest from the pipe to the file
+    while (ring == nullptr && done < len && err == 0) {
+        loff_t off = offset + done;
+        ssize_t res = splice(infd, NULL, fd, &off, len - done, SPLICE_F_MOVE);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL)
+                err = errno;
+            break;
+        } else if (res == 0) {
+            dbg() << "End of input." << endl;
+            throw EofException();
+        }
+        done += res;
+        payloadLeft -= res;
+    }
+
+    // splice() is not supported for infd or fd, copy the rest
+    char buf[16 * 1024];
+    while (done < len && err == 0) {
+        size_t n = min(len - done, sizeof(buf));
+        readDirect(buf, n);
+        payloadLeft -= n;
+        size_t written = 0;
+        while (written < n && err == 0) {
+            ssize_t res = pwrite(fd, buf + written, n - written, offset + done + written);
+            if (res == -1)
+                err = errno;
+            else
+                written += res;
+        }
+        done += n;
+    }
+
+    skipPayload();
+    return err != 0 ? -err : (ssize_t)done;
+}
+
+void Channel::skipPayload()
+{
+    char buf[16 * 1024];
+    while (payloadLeft > 0) {
+        size_t n = min(payloadLeft, sizeof(buf));
+        readDirect(buf, n);
+        payloadLeft -= n;
+    }
+}
+
+void Channel::writeAll(const char *data, size_t len)
+{
+    if (ring != nullptr) {
+        ring->write(data, len, infd);
+        return;
+    }
+    while (len > 0) {
+        ssize_t res = ::write(outfd, data, len);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            throw EofException();
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+// Send a payload which has not been sent together with the header:
+// from a pipe (with splice()) or from memory (with vmsplice()).
+void Channel::writePayload(const Encoder &enc)
+{
+    size_t left = enc.payloadLen;
+    while (ring == nullptr && left > 0) {
+        ssize_t res;
+        if (enc.payloadPipe != -1) {
+            res = splice(enc.payloadPipe, NULL, outfd, NULL, left, SPLICE_F_MOVE);
+        } else {
+            struct iovec iov;
+            iov.iov_base = const_cast<char *>(enc.payload + enc.payloadLen - left);
+            iov.iov_len  = left;
+            res = vmsplice(outfd, &iov, 1, 0);
+        }
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL && errno != EBADF) {
+                perror("splice");
+                throw EofException();
+            }
+            break;
+        }
+        left -= res;
+    }
+
+    // outfd is not a pipe (or the shared ring is used), copy the rest
+    if (enc.payloadPipe == -1) {
+        writeAll(enc.payload + enc.payloadLen - left, left);
+        return;
+    }
+    char buf[16 * 1024];
+    while (left > 0) {
+        ssize_t res = ::read(enc.payloadPipe, buf, min(left, sizeof(buf)));
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR)
+                continue;
+            perror("read");
+            throw EofException();
+        }
+        writeAll(buf, res);
+        left -= res;
+    }
+}
+
+bool Channel::shouldCompress(const Encoder &enc)
+{
+    if (!compression || !enc.compressible || enc.payloadPipe != -1 || !enc.fds.empty() ||
+        enc.size() < COMPRESSION_THRESHOLD)
+        return false;
+    lock_guard<mutex> lock(ratioMutex);
+    if (skipCompression > 0) {
+        --skipCompression;
+        return false;
+    }
+    return true;
+}
+
+void Channel::updateRatio(size_t compressed, size_t uncompressed)
+{
+    lock_guard<mutex> lock(ratioMutex);
+    ratio = 0.75 * ratio + 0.25 * ((double)compressed / uncompressed);
+    if (ratio > 0.9) {
+        // data does not compress well, try again later
+        dbg() << "Compression ratio " << ratio << ", pausing compression." << endl;
+        skipCompression = 64;
+        ratio = 0.0;
+    }
+}
+
+// Per-thread deflate state, so that compression does not have to
+// hold the send lock.
+struct Deflater {
+    z_stream zs;
+    bool ok;
+    Deflater() {
+        memset(&zs, 0, sizeof(zs));
+        ok = deflateInit(&zs, Z_BEST_SPEED) == Z_OK;
+    }
+    ~Deflater() {
+        if (ok)
+            deflateEnd(&zs);
+    }
+};
+
+// Returns false if the message does not get smaller (nothing has
+// been sent then).
+bool Channel::sendCompressed(Encoder &enc)
+{
+    static thread_local Deflater deflater;
+    static thread_local string zbuf;
+    if (!deflater.ok)
+        return false;
+
+    const size_t prefix = 2 * sizeof(uint32_t);
+    size_t hlen = enc.header.size() - prefix;
+    size_t total = hlen + enc.payloadLen;
+
+    z_stream *zs = &deflater.zs;
+    deflateReset(zs);
+    size_t bound = deflateBound(zs, total);
+    zbuf.resize(prefix + sizeof(uint32_t) + bound);
+    zs->next_out  = (Bytef *)&zbuf[prefix + sizeof(uint32_t)];
+    zs->avail_out = bound;
+    zs->next_in   = (Bytef *)&enc.header[prefix];
+    zs->avail_in  = hlen;
+    int res = deflate(zs, enc.payloadLen > 0 ? Z_NO_FLUSH : Z_FINISH);
+    if (res == Z_OK && enc.payloadLen > 0) {
+        zs->next_in  = (Bytef *)enc.payload;
+        zs->avail_in = enc.payloadLen;
+        res = deflate(zs, Z_FINISH);
+    }
+    if (res != Z_STREAM_END)
+        return false;
+    size_t clen = bound - zs->avail_out;
+    updateRatio(clen, total);
+    if (clen + sizeof(uint32_t) >= total)
+        return false;
+
+    uint32_t len[3];
+    len[0] = htonl(clen | COMPRESSED_FRAME);
+    len[1] = htonl(enc.payloadLen);
+    len[2] = htonl(hlen);
+    memcpy(&zbuf[0], len, sizeof(len));
+
+    lock_guard<mutex> lock(sendMutex);
+    writeAll(zbuf.data(), sizeof(len) + clen);
+    return true;
+}
+
+void Channel::send(Encoder &enc)
+{
+    if (shouldCompress(enc) && sendCompressed(enc))
+        return;
+
+    if (enc.format == BINARY) {
+        uint32_t len[2];
+        len[0] = htonl(enc.header.size() - sizeof(len));
+        len[1] = htonl(enc.payloadLen);
+        memcpy(&enc.header[0], len, sizeof(len));
+    }
+
+    // small payloads from memory are sent together with the header
+    bool separatePayload = enc.payloadPipe != -1 ||
+        (enc.payloadStable && enc.payloadLen >= SPLICE_THRESHOLD);
+
+    struct iovec iov[2];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = &enc.header[0];
+    iov[iovcnt].iov_len  = enc.header.size();
+    ++iovcnt;
+    if (enc.payloadLen > 0 && !separatePayload) {
+        iov[iovcnt].iov_base = const_cast<char *>(enc.payload);
+        iov[iovcnt].iov_len  = enc.payloadLen;
+        ++iovcnt;
+    }
+
+    lock_guard<mutex> lock(sendMutex);
+    if (ring != nullptr) {
+        for (int i=0; i<iovcnt; ++i)
+            writeAll((const char *)iov[i].iov_base, iov[i].iov_len);
+        if (separatePayload)
+            writePayload(enc);
+        return;
+    }
+    struct iovec *v = iov;
+    bool passFds = fdPassing && !enc.fds.empty();
+    while (iovcnt > 0) {
+        ssize_t res;
+        if (passFds)
+            res = writeFds(v, iovcnt, enc.fds);
+        else
+            res = writev(outfd, v, iovcnt);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            throw EofException();
+        }
+        passFds = false;
+        // continue after a partial write
+        while (iovcnt > 0 && (size_t)res >= v->iov_len) {
+            res -= v->iov_len;
+            ++v;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + res;
+            v->iov_len -= res;
+        }
+    }
+    if (separatePayload)
+        writePayload(enc);
+}
+
+
+// The file descriptors are attached to the first bytes of the message.
+ssize_t Channel::writeFds(const struct iovec *iov, int iovcnt, const vector<int> &fds)
+{
+    vector<char> cbuf(CMSG_SPACE(fds.size() * sizeof(int)));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = iovcnt;
+    msg.msg_control = cbuf.data();
+    msg.msg_controllen = cbuf.size();
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds.data(), fds.size() * sizeof(int));
+    return sendmsg(outfd, &msg, MSG_NOSIGNAL);
+}
+
+// The pipe is large enough for 'len' bytes even if the file data does
+// not start at a page boundary (each page occupies one pipe buffer).
+static int scratchPipe(size_t len, int &readfd)
+{
+    static thread_local int pipefd[2] = { -1, -1 };
+    if (pipefd[0] == -1 && pipe2(pipefd, O_CLOEXEC) == -1)
+        return -1;
+    readfd = pipefd[0];
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t needed = (len + 2 * pagesize - 1) / pagesize * pagesize;
+    int size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    if (size != -1 && (size_t)size < needed)
+        size = fcntl(pipefd[1], F_SETPIPE_SZ, needed);
+    if (size == -1 || (size_t)size < needed)
+        return -1;
+    return pipefd[1];
+}
+
+ssize_t erlent::spliceToPipe(int fd, off_t offset, size_t len, int &pipefd)
+{
+    int wfd = scratchPipe(len, pipefd);
+    if (wfd == -1)
+        return -1;
+    size_t done = 0;
+    while (done < len) {
+        loff_t off = offset + done;
+        ssize_t res = splice(fd, &off, wfd, NULL, len - done, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (res == 0)
+            break;
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            // drain the pipe, the caller falls back to read()
+            char buf[16 * 1024];
+            while (done > 0) {
+                ssize_t n = ::read(pipefd, buf, min(done, sizeof(buf)));
+                if (n <= 0)
+                    break;
+                done -= n;
+            }
+            errno = err;
+            return -1;
+        }
+        done += res;
+    }
+    return done;
+}
+
+
+Encoder &erlent::writestr(Encoder &enc, const string &str) {
+//    dbg() << "Writing '" << str << "'." << endl;
+    writenum(enc, str.length());
+    enc.write(str.data(), str.length());
+    return enc;
+}
+
+Decoder &erlent::readstr(Decoder &dec, string &str) {
+    size_t len;
+    readnum(dec, len);
+//    dbg() << "len = " << len << endl;
+    dec.require(len);
+    str.resize(len);
+    dec.read(&str[0], len);
+    return dec;
+}
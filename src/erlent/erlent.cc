@@ -1,5 +1,8 @@
 #include "erlent/erlent.hh"
+#include "erlent/metacache.hh"
+#include "erlent/sha256.hh"
 
+#include <climits>
 #include <cstring>
 
 #include <algorithm>
@@ -28,37 +31,6 @@ ostream &erlent::dbg() {
     return GlobalOptions::isDebug() ? std::cerr : dbgnull;
 }
 
-char erlent::getnextchar(istream &is) {
-    int c = is.get();
-    if (c == EOF) {
-        dbg() << "End of input." << endl;
-        throw EofException();
-    }
-    return (char)c;
-}
-
-ostream &erlent::writestr(ostream &os, const string &str) {
-//    dbg() << "Writing '" << str << "'." << endl;
-    writenum(os, str.length());
-    os << str;
-    return os;
-}
-
-istream &erlent::readstr(istream &is, string &str) {
-    int len;
-    readnum(is, len);
-//    dbg() << "len = " << len << endl;
-    char *cstr = (char *)alloca((len+1) * sizeof(char));
-    is.read(cstr, len);
-    if (is.gcount() != len) {
-        fprintf(stderr, "Could not read %d bytes\n", len);
-        throw EofException();
-    }
-    cstr[len] = '\0';
-    str = cstr;
-    return is;
-}
-
 string Message::typeName(Message::Type ty)
 {
     switch(ty) {
@@ -82,233 +54,474 @@ string Message::typeName(Message::Type ty)
     case RMDIR:    return "Rmdir";
     case UTIMENS:  return "Utimens";
     case STATFS:   return "Statfs";
+    case HELLO:    return "Hello";
+    case COMPOUND: return "Compound";
+    case INVALIDATE: return "Invalidate";
+    case READDIRPLUS: return "Readdirplus";
+    case MANIFEST: return "Manifest";
+    case CHECKSUMS: return "Checksums";
     }
     return "(unknown, missing in Message::typeName)";
 }
 
-Request *Request::receive(istream &is)
+void Message::send(Channel &ch) const
 {
-    Message::Type msgtype;
-    Request *req = 0;
-
-    int imsgtype;
-    readnum(is, imsgtype);
-    msgtype = Message::Type(imsgtype);
+    if (GlobalOptions::isDebug()) {
+        dbg() << "send: ";
+        print(dbg());
+        dbg() << endl;
+    }
+    Encoder enc(ch.getFormat());
+    enc.reserve(encodedSize(ch.getFormat()));
+    serialize(enc);
+    ch.send(enc);
+}
 
-    dbg() << "receive: msgtype=" << msgtype << endl;
+Request *Request::create(Message::Type msgtype)
+{
     switch(msgtype) {
-    case GETATTR:  req = new GetattrRequest();  break;
-    case ACCESS:   req = new AccessRequest();   break;
-    case MKNOD:    req = new MknodRequest();    break;
-    case READDIR:  req = new ReaddirRequest();  break;
-    case READLINK: req = new ReadlinkRequest(); break;
-    case READ:     req = new ReadRequest();     break;
-    case WRITE:    req = new WriteRequest();    break;
-    case OPEN:     req = new OpenRequest();     break;
-    case CREAT:    req = new CreatRequest();    break;
-    case TRUNCATE: req = new TruncateRequest(); break;
-    case CHMOD:    req = new ChmodRequest();    break;
-    case CHOWN:    req = new ChownRequest();    break;
-    case MKDIR:    req = new MkdirRequest();    break;
-    case SYMLINK:  req = new SymlinkRequest();  break;
-    case LINK:     req = new LinkRequest();     break;
-    case RENAME:   req = new RenameRequest();   break;
-    case UNLINK:   req = new UnlinkRequest();   break;
-    case RMDIR:    req = new RmdirRequest();    break;
-    case UTIMENS:  req = new UtimensRequest();  break;
-    case STATFS:   req = new StatfsRequest();   break;
+    case GETATTR:  return new GetattrRequest();
+    case ACCESS:   return new AccessRequest();
+    case MKNOD:    return new MknodRequest();
+    case READDIR:  return new ReaddirRequest();
+    case READLINK: return new ReadlinkRequest();
+    case READ:     return new ReadRequest();
+    case WRITE:    return new WriteRequest();
+    case OPEN:     return new OpenRequest();
+    case CREAT:    return new CreatRequest();
+    case TRUNCATE: return new TruncateRequest();
+    case CHMOD:    return new ChmodRequest();
+    case CHOWN:    return new ChownRequest();
+    case MKDIR:    return new MkdirRequest();
+    case SYMLINK:  return new SymlinkRequest();
+    case LINK:     return new LinkRequest();
+    case RENAME:   return new RenameRequest();
+    case UNLINK:   return new UnlinkRequest();
+    case RMDIR:    return new RmdirRequest();
+    case UTIMENS:  return new UtimensRequest();
+    case STATFS:   return new StatfsRequest();
+    case HELLO:    return new HelloRequest();
+    case COMPOUND: return new CompoundRequest();
+    case READDIRPLUS: return new ReaddirplusRequest();
+    case MANIFEST: return new ManifestRequest();
+    case CHECKSUMS: return new ChecksumsRequest();
+    case INVALIDATE: break;     // only sent by erlent-server
     }
 
     // We do not use a default: case since GCC generates
     // a warning for missing cases for an enum when no
     // default: case is present.
+    return nullptr;
+}
+
+Request *Request::receive(Channel &ch)
+{
+    Decoder dec(ch);
+    Message::Type msgtype;
+    Request *req;
+
+    int imsgtype;
+    readnum(dec, imsgtype);
+    msgtype = Message::Type(imsgtype);
+
+    dbg() << "receive: msgtype=" << msgtype << endl;
+    req = RequestPool::get(msgtype);
     if (!req) {
         cerr << "Received unknown message type " << msgtype
              << ", cannot continue." << endl;
         exit(1);
     }
-    req->deserialize(is);
+    req->deserialize(dec);
+    req->getReply().setTag(req->getTag());
+    if (GlobalOptions::isDebug()) {
+        dbg() << "received: ";
+        req->print(dbg());
+        dbg() << endl;
+    }
     return req;
 }
 
-void Reply::receive(istream &is)
+void Reply::receive(Channel &ch)
 {
+    Decoder dec(ch);
     int msgtype;
+    uint32_t tag;
 
-    readnum(is, msgtype);
+    receiveHeader(dec, msgtype, tag);
+    decode(dec, msgtype);
+}
+
+void Reply::receiveHeader(Decoder &dec, int &msgtype, uint32_t &tag)
+{
+    readnum(dec, msgtype);
+    tag = 0;
+    if (dec.getFormat() == BINARY)
+        readnum(dec, tag);
+}
+
+void Reply::decode(Decoder &dec, int msgtype)
+{
     if (msgtype != getMessageType()) {
         cerr << "Received wrong answer type (" << msgtype << ") instead\n"
              << "of expected type " << getMessageType() << ", cannot continue." << endl;
         exit(1);
     }
 
-    deserialize(is);
+    deserialize(dec);
+    if (GlobalOptions::isDebug()) {
+        dbg() << "received: ";
+        print(dbg());
+        dbg() << endl;
+    }
+}
+
+void Reply::writeHeader(Encoder &enc) const
+{
+    writenum(enc, (int)getMessageType());
+    if (enc.getFormat() == BINARY)
+        writenum(enc, tag);
 }
 
-void Reply::serialize(ostream &os) const
+size_t Reply::headerSize(WireFormat format) const
 {
-    dbg() << "Serializing " << typeName(getMessageType()) << " reply, result is "
-          << getResult() << " (" << getResultMessage() << ")." << endl;
-    writenum(os, getMessageType());
-    writenum(os, getResult());
+    FieldSizer s(format);
+    s("type", (int)getMessageType());
+    if (format == BINARY)
+        s("tag", tag);
+    return s.size();
 }
 
-void Reply::deserialize(istream &is)
+void Reply::printHeader(ostream &os) const
 {
-    dbg() << "Deserializing " << typeName(getMessageType()) << " reply." << endl;
-    readnum(is, result);
+    os << typeName(getMessageType()) << " reply (tag " << tag << "):";
 }
 
-void Request::perform(ostream &os)
+void Request::perform(Channel &ch)
 {
     performLocally();
-    getReply().serialize(os);
+    getReply().send(ch);
+}
+
+const string &Request::getOrderingPath() const
+{
+    static const string none;
+    return none;
+}
+
+void Request::writeHeader(Encoder &enc) const
+{
+    writenum(enc, (int)getMessageType());
+    if (enc.getFormat() == BINARY)
+        writenum(enc, tag);
+}
+
+// the message type has been read by receive() already
+void Request::readHeader(Decoder &dec)
+{
+    if (dec.getFormat() == BINARY)
+        readnum(dec, tag);
+}
+
+size_t Request::headerSize(WireFormat format) const
+{
+    FieldSizer s(format);
+    s("type", (int)getMessageType());
+    if (format == BINARY)
+        s("tag", tag);
+    return s.size();
+}
+
+void Request::printHeader(ostream &os) const
+{
+    os << typeName(getMessageType()) << " request (tag " << tag << "):";
 }
 
-void Request::serialize(ostream &os) const
+// The entries [begin, end) of a cached listing that make up the page
+// after 'cookie' with at most 'max' entries (0: no limit), and the
+// cookie to continue with; false if no entry has that cookie (the
+// directory is read again then).
+static bool cachedPage(const vector<uint64_t> &cookies, uint64_t cookie, uint32_t max,
+                       size_t &begin, size_t &end, uint64_t &next)
 {
-    dbg() << "Serializing " << typeName(getMessageType()) << " request." << endl;
-    writenum(os, getMessageType());
+    begin = 0;
+    if (cookie != 0) {
+        while (begin < cookies.size() && cookies[begin] != cookie)
+            ++begin;
+        if (begin == cookies.size())
+            return false;
+        ++begin;
+    }
+    end = cookies.size();
+    next = 0;
+    if (max != 0 && end - begin > max) {
+        end = begin + max;
+        next = cookies[end - 1];
+    }
+    return true;
 }
 
-void Request::deserialize(istream &is)
+// Listings are cached only if they do not have more entries than this
+// (the first page of larger directories is sent without reading them
+// completely).
+static const size_t MAX_CACHED_LISTING = 4096;
+
+// Open the directory and position it after 'cookie'.
+static DIR *openAt(const string &path, uint64_t cookie)
 {
-    dbg() << "Deserializing " << typeName(getMessageType()) << " request." << endl;
+    DIR *dir = opendir(path.c_str());
+    if (dir != NULL && cookie != 0)
+        seekdir(dir, (long)cookie);
+    return dir;
 }
 
 void ReaddirRequest::performLocally()
 {
     ReaddirReply &rr = getReply();
     int res;
-    DIR *dir;
-    dir = opendir(getPathname().c_str());
+    vector<string> names;
+    vector<uint64_t> cookies;
+    MetadataCache::Miss miss;
+    if (MetadataCache::lookupDir(getPathname(), res, names, cookies, miss)) {
+        size_t begin, end;
+        uint64_t next;
+        if (res < 0 || cachedPage(cookies, cookie, maxEntries, begin, end, next)) {
+            if (res == 0) {
+                for (size_t i=begin; i<end; ++i)
+                    rr.addName(names[i]);
+                rr.setCookie(next);
+            }
+            rr.setResult(res);
+            return;
+        }
+        names.clear();
+        cookies.clear();
+    }
+    // only complete listings are cached
+    const bool caching = MetadataCache::isEnabled() && cookie == 0;
+    uint64_t next = 0;
+    DIR *dir = openAt(getPathname(), cookie);
     if (dir != NULL) {
         errno = 0;
         struct dirent *de = readdir(dir);
         while (de) {
-            // cerr << " ### " << de->d_name << endl;
             rr.addName(de->d_name);
+            if (caching) {
+                names.push_back(de->d_name);
+                cookies.push_back(de->d_off);
+            }
+            if (maxEntries != 0 && rr.size() == maxEntries) {
+                next = de->d_off;
+                break;
+            }
             errno = 0;
             de = readdir(dir);
         }
-        res = -errno;
+        // read the rest of the listing to cache it (further pages
+        // are taken from the cache then)
+        while (de && caching && names.size() <= MAX_CACHED_LISTING) {
+            errno = 0;
+            de = readdir(dir);
+            if (de) {
+                names.push_back(de->d_name);
+                cookies.push_back(de->d_off);
+            }
+        }
+        res = de != NULL ? 0 : -errno;
         closedir(dir);
     } else
         res = -errno;
 
+    if (caching && names.size() <= MAX_CACHED_LISTING)
+        MetadataCache::storeDir(miss, res, names, cookies);
+    rr.setCookie(next);
     rr.setResult(res);
 }
 
 
-void ReaddirReply::serialize(ostream &os) const
+void ReaddirReply::filter(std::function<bool (const string &)> pred)
 {
-    this->Reply::serialize(os);
-    writenum(os, names.size());
-
-    vector<string>::const_iterator it, end = names.end();
-    for (it=names.begin(); it!=end; ++it) {
-        writestr(os, *it);
+    auto it = names.begin();
+    while (it != names.end()) {
+        if (!pred(*it))
+            it = names.erase(it);
+        else
+            ++it;
     }
 }
 
-void ReaddirReply::deserialize(istream &is)
+void ReaddirplusRequest::performLocally()
 {
-    this->Reply::deserialize(is);
-    int n;
-    readnum(is, n);
-    while (n-- > 0) {
-        string str;
-        readstr(is, str);
-        names.push_back(str);
+    ReaddirplusReply &rr = getReply();
+    int res;
+    vector<string> names;
+    vector<uint64_t> cookies;
+    vector<struct stat> stbufs;
+    MetadataCache::Miss miss;
+    if (MetadataCache::lookupDirAttrs(getPathname(), res, names, cookies, stbufs, miss)) {
+        size_t begin, end;
+        uint64_t next;
+        if (res < 0 || cachedPage(cookies, cookie, maxEntries, begin, end, next)) {
+            if (res == 0) {
+                string dir = getPathname();
+                if (*dir.rbegin() != '/')
+                    dir += '/';
+                for (size_t i=begin; i<end; ++i) {
+                    if (stbufs[i].st_mode == 0 && lstat((dir + names[i]).c_str(), &stbufs[i]) == -1)
+                        memset(&stbufs[i], 0, sizeof(stbufs[i]));
+                    rr.addEntry(names[i], stbufs[i], cookies[i]);
+                }
+                rr.setCookie(next);
+            }
+            rr.setResult(res);
+            return;
+        }
+        names.clear();
+        cookies.clear();
+        stbufs.clear();
     }
+    const bool caching = MetadataCache::isEnabled() && cookie == 0;
+    uint64_t next = 0;
+    DIR *dir = openAt(getPathname(), cookie);
+    if (dir != NULL) {
+        errno = 0;
+        struct dirent *de = readdir(dir);
+        while (de) {
+            struct stat stbuf;
+            if (fstatat(dirfd(dir), de->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+                memset(&stbuf, 0, sizeof(stbuf));
+            }
+            rr.addEntry(de->d_name, stbuf, de->d_off);
+            if (caching) {
+                names.push_back(de->d_name);
+                cookies.push_back(de->d_off);
+                stbufs.push_back(stbuf);
+            }
+            if (maxEntries != 0 && rr.size() == maxEntries) {
+                next = de->d_off;
+                break;
+            }
+            errno = 0;
+            de = readdir(dir);
+        }
+        while (de && caching && names.size() <= MAX_CACHED_LISTING) {
+            errno = 0;
+            de = readdir(dir);
+            if (de) {
+                struct stat stbuf;
+                if (fstatat(dirfd(dir), de->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+                    memset(&stbuf, 0, sizeof(stbuf));
+                names.push_back(de->d_name);
+                cookies.push_back(de->d_off);
+                stbufs.push_back(stbuf);
+            }
+        }
+        res = de != NULL ? 0 : -errno;
+        closedir(dir);
+    } else
+        res = -errno;
+
+    if (caching && names.size() <= MAX_CACHED_LISTING)
+        MetadataCache::storeDirAttrs(miss, res, names, cookies, stbufs);
+    rr.setCookie(next);
+    rr.setResult(res);
 }
 
-void ReaddirReply::filter(std::function<bool (const string &)> pred)
+void ReaddirplusReply::filter(std::function<bool (const string &)> pred)
 {
-    auto it = names.begin();
-    while (it != names.end()) {
-        if (!pred(*it))
-            it = names.erase(it);
+    auto it = entries.begin();
+    while (it != entries.end()) {
+        if (!pred(it->name))
+            it = entries.erase(it);
         else
             ++it;
     }
 }
 
 
-void GetattrRequest::perform(ostream &os)
+void GetattrRequest::perform(Channel &ch)
 {
     struct stat stbuf;
     GetattrReply &repl = getReply();
     repl.init(&stbuf);
     performLocally();
-    repl.serialize(os);
+    grantLease(ch);
+    repl.send(ch);
+}
+
+void GetattrRequest::performNested(Channel &ch)
+{
+    getReply().init(&stbuf);
+    performLocally();
+    grantLease(ch);
+}
+
+void GetattrRequest::grantLease(Channel &ch)
+{
+    LeaseHolder *holder = ch.getLeaseHolder();
+    if (holder != nullptr) {
+        GetattrReply &repl = getReply();
+        repl.setLease(MetadataCache::leaseAttr(getPathname(), repl.getResult(), *repl.getStbuf(), holder));
+    }
 }
 
 void GetattrRequest::performLocally()
 {
     GetattrReply &repl = getReply();
     const string &pathname = getPathname();
+    int res;
+    MetadataCache::Miss miss;
+    if (MetadataCache::lookupAttr(pathname, res, *repl.getStbuf(), miss)) {
+        repl.setResult(res);
+        return;
+    }
     dbg() << "(l)stating '" << pathname << "'." << endl;
-    int res = lstat(pathname.c_str(), repl.getStbuf());
+    res = lstat(pathname.c_str(), repl.getStbuf());
     if (res == -1)
         res = -errno;
+    MetadataCache::storeAttr(miss, res, *repl.getStbuf());
     repl.setResult(res);
 }
 
 
-void GetattrReply::serialize(ostream &os) const
+void ReadRequest::perform(Channel &ch)
 {
-    this->Reply::serialize(os);
-    writenum(os, stbuf->st_mode);
-    writenum(os, stbuf->st_nlink);
-    writenum(os, stbuf->st_uid);
-    writenum(os, stbuf->st_gid);
-    writenum(os, stbuf->st_rdev);
-    writenum(os, stbuf->st_size);
-    writenum(os, stbuf->st_atime);
-    writenum(os, stbuf->st_mtime);
-    writenum(os, stbuf->st_ctime);
+    // compressed data (and data sent through the shared ring) has
+    // to go through user space anyway
+    if (size >= SPLICE_THRESHOLD && !ch.isCompressing() && !ch.isUsingSharedRing() &&
+        performSpliced(ch))
+        return;
+
+    performNested(ch);
+    getReply().send(ch);
+    buffer.release();
 }
 
-void GetattrReply::deserialize(istream &is)
+void ReadRequest::performNested(Channel &ch)
 {
-    this->Reply::deserialize(is);
-    readnum(is, stbuf->st_mode);
-    readnum(is, stbuf->st_nlink);
-    readnum(is, stbuf->st_uid);
-    readnum(is, stbuf->st_gid);
-    readnum(is, stbuf->st_rdev);
-    readnum(is, stbuf->st_size);
-    readnum(is, stbuf->st_atime);
-    readnum(is, stbuf->st_mtime);
-    readnum(is, stbuf->st_ctime);
+    buffer.reset(size);
+    getReply().init(buffer.get(), size);
+    performLocally();
 }
 
-void ReadRequest::serialize(ostream &os) const
+// Move the data from the file to the channel with splice(), without
+// copying it to user space. Returns false (without having sent
+// anything) if the data must be read into a buffer instead.
+bool ReadRequest::performSpliced(Channel &ch)
 {
-    this->RequestWithPathname::serialize(os);
-    writenum(os, size);
-    writenum(os, offset);
-}
-
-void ReadRequest::deserialize(istream &is) {
-    this->RequestWithPathname::deserialize(is);
-    readnum(is, size);
-    readnum(is, offset);
-    dbg() << "ReadRequest for '" << getPathname() << "', " << size << ", " << offset << endl;
-}
+    int fd = open(getPathname().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    int pipefd;
+    ssize_t res = spliceToPipe(fd, offset, size, pipefd);
+    close(fd);
+    if (res == -1)
+        return false;
 
-void ReadRequest::perform(ostream &os)
-{
     ReadReply &rr = getReply();
-    char *data = new char[size];
-    if (data) {
-        rr.init(data, size);
-        performLocally();
-    } else
-        rr.setResult(-ENOMEM);
-    rr.serialize(os);
-    delete[] data;
+    rr.initPipe(pipefd);
+    rr.setResult(res);
+    rr.send(ch);
+    return true;
 }
 
 void ReadRequest::performLocally()
@@ -330,40 +543,81 @@ void ReadRequest::performLocally()
     getReply().setResult(res);
 }
 
-void ReadReply::serialize(ostream &os) const
+void ReadReply::serialize(Encoder &enc) const
 {
-    this->Reply::serialize(os);
-    if (getResult() > 0)
-        os.write(data, getResult());
+    serializeFields(*this, enc);
+    enc.setCompressible();
+    if (getResult() > 0) {
+        if (pipefd != -1)
+            enc.setPayloadPipe(pipefd, getResult());
+        else
+            enc.setPayload(data, getResult());
+    }
 }
 
-void ReadReply::deserialize(istream &is)
+void ReadReply::deserialize(Decoder &dec)
 {
-    dbg() << "deserializing ReadReply" << endl;
-    this->Reply::deserialize(is);
+    deserializeFields(*this, dec);
     int res = getResult();
-    if (res > 0 && (size_t)res <= len)
-        is.read(data, res);
+    if (res > 0) {
+        if ((size_t)res <= len)
+            dec.readPayload(data, res);
+        else {
+            // (more than was asked for, and none of it in 'data')
+            dec.beginPayload(res);  // skipped with the next message
+            setResult(-EIO);
+        }
+    }
+}
+
+
+void WriteRequest::serialize(Encoder &enc) const
+{
+    serializeFields(*this, enc);
+    // the caller waits for the reply, so the data stays valid
+    // until erlent-server has consumed it
+    enc.setPayload(data, size, true);
+    enc.setCompressible();
 }
 
+void WriteRequest::deserialize(Decoder &dec)
+{
+    deserializeFields(*this, dec);
+    dec.beginPayload(size);
+    data = nullptr;
+}
 
-void WriteRequest::serialize(ostream &os) const
+void WriteRequest::perform(Channel &ch)
 {
-    this->Super::serialize(os);
-    writenum(os, size);
-    writenum(os, offset);
-    os.write(data, size);
+    performNested(ch);
+    getReply().send(ch);
 }
 
-void WriteRequest::deserialize(istream &is)
+void WriteRequest::performNested(Channel &ch)
 {
-    this->Super::deserialize(is);
-    readnum(is, size);
-    readnum(is, offset);
-    char *datap = new char[size];
-    is.read(datap, size);
-    data = datap;
-    del_data = true;
+    if (data != nullptr) {
+        performLocally();
+        return;
+    }
+    int res;
+    int fd = open(getPathname().c_str(), O_WRONLY);
+    if (fd != -1) {
+        res = ch.splicePayload(fd, offset, size);
+        close(fd);
+    } else {
+        res = -errno;
+        ch.skipPayload();
+    }
+    getReply().setResult(res);
+}
+
+void WriteRequest::receivePayload(Channel &ch)
+{
+    if (data != nullptr)
+        return;
+    buffer.reset(size);
+    ch.readPayload(buffer.get(), size);
+    data = buffer.get();
 }
 
 void WriteRequest::performLocally()
@@ -384,18 +638,26 @@ void WriteRequest::performLocally()
     getReply().setResult(res);
 }
 
-void OpenRequest::serialize(ostream &os) const
+void OpenRequest::perform(Channel &ch)
 {
-    this->RequestWithPathnameTempl::serialize(os);
-    this->Mode::serialize(os);
-    writenum(os, flags);
+    performNested(ch);
+    getReply().send(ch);
+    getReply().closeFd();
 }
 
-void OpenRequest::deserialize(istream &is)
+// pass the open file to the client if the channel allows it
+void OpenRequest::performNested(Channel &ch)
 {
-    this->RequestWithPathnameTempl::deserialize(is);
-    this->Mode::deserialize(is);
-    readnum(is, flags);
+    if (!ch.isPassingFds()) {
+        performLocally();
+        return;
+    }
+    int res = 0;
+    int fd = open(getPathname().c_str(), flags | O_CLOEXEC, getMode());
+    if (fd == -1)
+        res = -errno;
+    getReply().setFd(fd);
+    getReply().setResult(res);
 }
 
 void OpenRequest::performLocally()
@@ -409,6 +671,34 @@ void OpenRequest::performLocally()
     getReply().setResult(res);
 }
 
+void OpenReply::closeFd()
+{
+    if (fd != -1)
+        close(fd);
+    fd = -1;
+    passedFds = 0;
+}
+
+void OpenReply::serialize(Encoder &enc) const
+{
+    serializeFields(*this, enc);
+    if (fd != -1)
+        enc.addFd(fd);
+}
+
+void OpenReply::deserialize(Decoder &dec)
+{
+    closeFd();
+    deserializeFields(*this, dec);
+    if (passedFds > 0) {
+        fd = dec.receiveFd();
+        if (fd == -1) {
+            cerr << "File descriptor missing in OPEN reply." << endl;
+            passedFds = 0;
+        }
+    }
+}
+
 void TruncateRequest::performLocally()
 {
     int res = truncate(getPathname().c_str(), val);
@@ -459,6 +749,8 @@ void RmdirRequest::performLocally()
 
 
 bool GlobalOptions::debug = false;
+int GlobalOptions::maxProtocol = PROTOCOL_MAX;
+unsigned GlobalOptions::features = 0;
 
 bool GlobalOptions::isDebug()
 {
@@ -470,19 +762,28 @@ void GlobalOptions::setDebug(bool dbg)
     debug = dbg;
 }
 
+int GlobalOptions::getMaxProtocol()
+{
+    return maxProtocol;
+}
 
+void GlobalOptions::setMaxProtocol(int version)
+{
+    maxProtocol = version;
+}
 
-void AccessRequest::serialize(ostream &os) const
+unsigned GlobalOptions::getFeatures()
 {
-    this->RequestWithPathname::serialize(os);
-    writenum(os, acc);
+    return features;
 }
 
-void AccessRequest::deserialize(istream &is) {
-    this->RequestWithPathname::deserialize(is);
-    readnum(is, acc);
+void GlobalOptions::setFeatures(unsigned features)
+{
+    GlobalOptions::features = features;
 }
 
+
+
 void AccessRequest::performLocally()
 {
     int res = access(getPathname().c_str(), acc);
@@ -504,33 +805,29 @@ void SymlinkRequest::performLocally()
 void ReadlinkRequest::performLocally()
 {
     char target[PATH_MAX+1];
-    int res = readlink(getPathname().c_str(), target, PATH_MAX);
+    string cached;
+    int res;
+    MetadataCache::Miss miss;
+    if (MetadataCache::lookupLink(getPathname(), res, cached, miss)) {
+        getReply().setTarget(cached.c_str());
+        getReply().setResult(res);
+        return;
+    }
+    res = readlink(getPathname().c_str(), target, PATH_MAX);
     if (res == -1) {
         res = -errno;
+        target[0] = '\0';
     } else {
         // readlink does NOT 0-terminate the result string
         target[res] = '\0';
         getReply().setTarget(target);
         res = 0;
     }
+    MetadataCache::storeLink(miss, res, target);
     getReply().setResult(res);
 }
 
 
-void CreatRequest::serialize(ostream &os) const
-{
-    this->RequestWithPathname::serialize(os);
-    this->UidGid::serialize(os);
-    this->Mode::serialize(os);
-}
-
-void CreatRequest::deserialize(istream &is)
-{
-    this->RequestWithPathname::deserialize(is);
-    this->UidGid::deserialize(is);
-    this->Mode::deserialize(is);
-}
-
 void CreatRequest::performLocally()
 {
     int res = 0;
@@ -542,20 +839,6 @@ void CreatRequest::performLocally()
     getReply().setResult(res);
 }
 
-ostream &erlent::writetimespec(ostream &os, const struct timespec &ts)
-{
-    writenum(os, ts.tv_sec);
-    writenum(os, ts.tv_nsec);
-    return os;
-}
-
-istream &erlent::readtimespec(istream &is, struct timespec &ts)
-{
-    readnum(is, ts.tv_sec);
-    readnum(is, ts.tv_nsec);
-    return is;
-}
-
 void UtimensRequest::performLocally()
 {
     int res = 0;
@@ -580,46 +863,158 @@ void LinkRequest::performLocally()
     getReply().setResult(res);
 }
 
-void StatfsReply::serialize(ostream &os) const
+void ChecksumsRequest::performLocally()
 {
-    this->ReplyTempl::serialize(os);
-    writenum(os, buf->f_bsize);
-    writenum(os, buf->f_frsize);
-    writenum(os, buf->f_blocks);
-    writenum(os, buf->f_bfree);
-    writenum(os, buf->f_bavail);
-    writenum(os, buf->f_files);
-    writenum(os, buf->f_ffree);
-    writenum(os, buf->f_favail);
-    writenum(os, buf->f_fsid);
-    writenum(os, buf->f_flag);
-    writenum(os, buf->f_namemax);
+    ChecksumsReply &repl = getReply();
+    if (offset < 0 || blockSize == 0 || blockSize > MAX_BLOCK_SIZE) {
+        repl.setResult(-EINVAL);
+        return;
+    }
+    int fd = open(getPathname().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        repl.setResult(-errno);
+        return;
+    }
+    int res = 0;
+    Buffer block(blockSize);
+    off_t pos = offset;
+    uint32_t blocks = min(count, MAX_BYTES / blockSize);
+    if (blocks > MAX_BLOCKS)
+        blocks = MAX_BLOCKS;
+    for (uint32_t i=0; i<blocks; ++i) {
+        size_t len = 0;
+        while (len < blockSize) {
+            ssize_t n = pread(fd, block.get() + len, blockSize - len, pos + len);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n == -1)
+                    res = -errno;
+                break;
+            }
+            len += n;
+        }
+        if (res < 0 || len == 0)
+            break;
+        repl.addSum(sha256(block.get(), len));
+        if (len < blockSize)
+            break;
+        pos += blockSize;
+    }
+    close(fd);
+    if (res < 0)
+        repl.clear();
+    repl.setResult(res);
+}
+
+void ManifestRequest::perform(Channel &ch)
+{
+    performNested(ch);
+    getReply().send(ch);
+    reply.clear();
 }
 
-void StatfsReply::deserialize(istream &is)
+// Walk the tree breadth first, so that the directories closest to the
+// root are listed when it is too large.
+void ManifestRequest::performNested(Channel &ch)
 {
-    this->ReplyTempl::deserialize(is);
-    readnum(is, buf->f_bsize);
-    readnum(is, buf->f_frsize);
-    readnum(is, buf->f_blocks);
-    readnum(is, buf->f_bfree);
-    readnum(is, buf->f_bavail);
-    readnum(is, buf->f_files);
-    readnum(is, buf->f_ffree);
-    readnum(is, buf->f_favail);
-    readnum(is, buf->f_fsid);
-    readnum(is, buf->f_flag);
-    readnum(is, buf->f_namemax);
+    ManifestReply &repl = getReply();
+    LeaseHolder *holder = ch.getLeaseHolder();
+    if (holder == nullptr || !MetadataCache::isEnabled()) {
+        repl.setResult(-EOPNOTSUPP);
+        return;
+    }
+    const string &root = getPathname();
+    vector<ManifestReply::Entry> &entries = repl.getEntries();
+    MetadataCache::Miss miss;
+    struct stat stbuf;
+    if (lstat(root.c_str(), &stbuf) == -1) {
+        repl.setResult(-errno);
+        return;
+    }
+    if (!S_ISDIR(stbuf.st_mode)) {
+        repl.setResult(-ENOTDIR);
+        return;
+    }
+    entries.push_back(ManifestReply::Entry{"", stbuf, "", 0});
+
+    // the indices of the directories to be listed
+    for (size_t next = 0; next < entries.size(); ++next) {
+        ManifestReply::Entry &e = entries[next];
+        if (!S_ISDIR(e.stbuf.st_mode))
+            continue;
+        string name = e.name;
+        string dir = name.empty() ? root : (root == "/" ? root : root + "/") + name;
+        if (!MetadataCache::watchTree(root, dir, miss))
+            continue;
+        DIR *dp = opendir(dir.c_str());
+        if (dp == NULL)
+            continue;
+        vector<ManifestReply::Entry> listing;
+        bool complete = true;
+        errno = 0;
+        while (struct dirent *de = readdir(dp)) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if (entries.size() + listing.size() >= MAX_ENTRIES) {
+                complete = false;
+                break;
+            }
+            ManifestReply::Entry child{name.empty() ? de->d_name : name + "/" + de->d_name,
+                                       {}, "", 0};
+            if (fstatat(dirfd(dp), de->d_name, &child.stbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+                complete = false;
+                break;
+            }
+            if (S_ISLNK(child.stbuf.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t len = readlinkat(dirfd(dp), de->d_name, target, sizeof(target));
+                if (len == -1) {
+                    complete = false;
+                    break;
+                }
+                child.target.assign(target, len);
+            }
+            listing.push_back(child);
+            errno = 0;
+        }
+        if (errno != 0)
+            complete = false;
+        closedir(dp);
+        if (!complete)
+            break;
+        entries[next].flags |= ManifestReply::LISTED;
+        entries.insert(entries.end(), listing.begin(), listing.end());
+    }
 
+    repl.setLease(MetadataCache::leaseTree(miss, holder));
+    if (repl.getLease() == 0) {
+        // (changed while it was read)
+        repl.clear();
+        repl.setResult(-EAGAIN);
+        return;
+    }
+    repl.setResult(0);
 }
 
-void StatfsRequest::perform(ostream &os)
+void ManifestRequest::performLocally()
+{
+    getReply().setResult(-EOPNOTSUPP);
+}
+
+void StatfsRequest::perform(Channel &ch)
 {
     StatfsReply &r = getReply();
     struct statvfs data;
     r.init(&data);
     performLocally();
-    r.serialize(os);
+    r.send(ch);
+}
+
+void StatfsRequest::performNested(Channel &ch)
+{
+    getReply().init(&buf);
+    performLocally();
 }
 
 void StatfsRequest::performLocally()
@@ -638,3 +1033,209 @@ void MknodRequest::performLocally()
         res = -errno;
     getReply().setResult(res);
 }
+
+void HelloRequest::performLocally()
+{
+    HelloReply &repl = getReply();
+    repl.setVersion(std::min(version, GlobalOptions::getMaxProtocol()));
+    repl.setFeatures(repl.getVersion() >= PROTOCOL_BINARY ? features & SUPPORTED_FEATURES : 0);
+    dbg() << "Client supports protocol version " << version
+          << ", using version " << repl.getVersion()
+          << " with features 0x" << hex << repl.getFeatures() << dec << "." << endl;
+    repl.setResult(0);
+}
+
+// File descriptors can only be passed over a Unix socket, and not
+// when the shared ring (if one has been set up) is used instead.
+// Leases need the metadata cache to notice changes.
+void HelloRequest::perform(Channel &ch)
+{
+    performLocally();
+    HelloReply &repl = getReply();
+    unsigned features = repl.getFeatures();
+    if (!ch.hasSharedRing())
+        features &= ~FEATURE_SHARED_RING;
+    if (!ch.isUnixSocket() || (features & FEATURE_SHARED_RING))
+        features &= ~FEATURE_FD_PASSING;
+    if (!MetadataCache::isEnabled())
+        features &= ~FEATURE_LEASES;
+    repl.setFeatures(features);
+    repl.send(ch);
+}
+
+void HelloReply::configure(Channel &ch) const
+{
+    ch.setFormat(getWireFormat());
+    ch.setCompression((features & FEATURE_COMPRESSION) != 0);
+    ch.setFdPassing((features & FEATURE_FD_PASSING) != 0);
+    ch.setSharedRing((features & FEATURE_SHARED_RING) != 0);
+}
+
+
+static bool carriesData(Message::Type ty)
+{
+    return ty == Message::READ || ty == Message::WRITE;
+}
+
+CompoundRequest::~CompoundRequest()
+{
+    if (owned) {
+        for (Request *req : requests)
+            delete req;
+    }
+}
+
+void CompoundRequest::serialize(Encoder &enc) const
+{
+    writeHeader(enc);
+    writenum(enc, requests.size());
+    for (size_t i=0; i<requests.size(); ++i) {
+        if (carriesData(requests[i]->getMessageType()) && i != requests.size()-1) {
+            cerr << typeName(requests[i]->getMessageType())
+                 << " request must be the last one of a compound request." << endl;
+            exit(1);
+        }
+        requests[i]->serialize(enc);
+    }
+}
+
+void CompoundRequest::deserialize(Decoder &dec)
+{
+    readHeader(dec);
+    size_t n;
+    readnum(dec, n);
+    owned = true;
+    for (size_t i=0; i<n; ++i) {
+        int imsgtype;
+        readnum(dec, imsgtype);
+        Message::Type msgtype = Message::Type(imsgtype);
+        Request *req = nullptr;
+        if (msgtype != HELLO && msgtype != COMPOUND &&
+            (!carriesData(msgtype) || i == n-1))
+            req = RequestPool::get(msgtype);
+        if (!req) {
+            cerr << "Received invalid message type " << msgtype
+                 << " in compound request, cannot continue." << endl;
+            exit(1);
+        }
+        requests.push_back(req);
+        req->deserialize(dec);
+    }
+}
+
+void CompoundRequest::reset()
+{
+    if (owned) {
+        for (Request *req : requests)
+            RequestPool::put(req);
+    }
+    requests.clear();
+    owned = false;
+}
+
+size_t CompoundRequest::encodedSize(WireFormat format) const
+{
+    FieldSizer s(format);
+    s("count", requests.size());
+    size_t size = headerSize(format) + s.size();
+    for (Request *req : requests)
+        size += req->encodedSize(format);
+    return size;
+}
+
+void CompoundRequest::print(ostream &os) const
+{
+    printHeader(os);
+    for (Request *req : requests) {
+        os << " [";
+        req->print(os);
+        os << "]";
+    }
+}
+
+int CompoundRequest::performEach(std::function<int (Request &)> perform)
+{
+    size_t n = 0;
+    while (n < requests.size()) {
+        int res = perform(*requests[n++]);
+        if (res < 0)
+            break;
+    }
+    for (size_t i=n; i<requests.size(); ++i)
+        requests[i]->getReply().setResult(-ECANCELED);
+    reply.setResult(n);
+    return n;
+}
+
+void CompoundRequest::perform(Channel &ch)
+{
+    performNested(ch);
+    reply.send(ch);
+}
+
+void CompoundRequest::performNested(Channel &ch)
+{
+    performEach([&ch](Request &req) {
+        req.performNested(ch);
+        return req.getReply().getResult();
+    });
+}
+
+// only the last request may carry a payload
+void CompoundRequest::receivePayload(Channel &ch)
+{
+    if (!requests.empty())
+        requests.back()->receivePayload(ch);
+}
+
+const string &CompoundRequest::getOrderingPath() const
+{
+    return requests.empty() ? Request::getOrderingPath() : requests.front()->getOrderingPath();
+}
+
+void CompoundRequest::performLocally()
+{
+    performEach([](Request &req) {
+        req.performLocally();
+        return req.getReply().getResult();
+    });
+}
+
+int CompoundRequest::processEach(RequestProcessor &rp)
+{
+    return performEach([&rp](Request &req) { return rp.process(req); });
+}
+
+void CompoundReply::serialize(Encoder &enc) const
+{
+    serializeFields(*this, enc);
+    for (int i=0; i<getResult(); ++i)
+        (*requests)[i]->getReply().serialize(enc);
+}
+
+void CompoundReply::deserialize(Decoder &dec)
+{
+    deserializeFields(*this, dec);
+    int n = getResult();
+    if (n < 0 || (size_t)n > requests->size()) {
+        cerr << "Received " << n << " replies to a compound request of "
+             << requests->size() << " requests, cannot continue." << endl;
+        exit(1);
+    }
+    for (int i=0; i<n; ++i) {
+        int msgtype;
+        uint32_t tag;
+        Reply::receiveHeader(dec, msgtype, tag);
+        (*requests)[i]->getReply().decode(dec, msgtype);
+    }
+    for (size_t i=n; i<requests->size(); ++i)
+        (*requests)[i]->getReply().setResult(-ECANCELED);
+}
+
+size_t CompoundReply::encodedSize(WireFormat format) const
+{
+    size_t size = fieldsSize(*this, format);
+    for (int i=0; i<getResult(); ++i)
+        size += (*requests)[i]->getReply().encodedSize(format);
+    return size;
+}
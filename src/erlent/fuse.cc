@@ -6,12 +6,16 @@ extern "C" {
 #include <sys/wait.h>
 }
 
+#include "erlent/blockcache.hh"
+#include "erlent/buffer.hh"
 #include "erlent/child.hh"
 #include "erlent/erlent.hh"
 #include "erlent/fuse.hh"
 
 using namespace erlent;
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <climits>
@@ -19,8 +23,17 @@ using namespace erlent;
 #include <fcntl.h>
 #include <csignal>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -28,35 +41,723 @@ using namespace std;
 
 static RequestProcessor *reqproc = nullptr;
 
+// The attributes of directory entries received with READDIRPLUS.
+// The kernel asks for them (with getattr) right after readdir, so each
+// of them is used once to answer a getattr if it is not older than
+// PREFETCH_TIMEOUT (the time the kernel caches attributes anyway).
+// Any modification drops all of them.
+static const time_t PREFETCH_TIMEOUT = 1;
+static mutex prefetchMutex;
+static map<string, pair<struct stat, time_t> > prefetched;
+
+static time_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool use_prefetched(const char *path, struct stat *stbuf) {
+    lock_guard<mutex> lock(prefetchMutex);
+    auto it = prefetched.find(path);
+    if (it == prefetched.end())
+        return false;
+    bool valid = now() - it->second.second <= PREFETCH_TIMEOUT;
+    if (valid)
+        *stbuf = it->second.first;
+    prefetched.erase(it);
+    return valid;
+}
+
+// The targets of symbolic links read together with their attributes
+// (see erlent_getattr), used once by readlink in the same way.
+static map<string, pair<string, time_t> > prefetchedLinks;
+
+static bool use_prefetched_link(const char *path, string &target) {
+    lock_guard<mutex> lock(prefetchMutex);
+    auto it = prefetchedLinks.find(path);
+    if (it == prefetchedLinks.end())
+        return false;
+    bool valid = now() - it->second.second <= PREFETCH_TIMEOUT;
+    if (valid)
+        target = it->second.first;
+    prefetchedLinks.erase(it);
+    return valid;
+}
+
+static void forget_prefetched() {
+    lock_guard<mutex> lock(prefetchMutex);
+    prefetched.clear();
+    prefetchedLinks.clear();
+}
+
+// The results of GETATTR leased by erlent-server (see GetattrReply),
+// used until the lease ends or is revoked. Results of requests sent
+// before an invalidation are not cached, as they may have been
+// determined before the change (see leaseGeneration).
+struct LeasedAttrs {
+    int res;
+    struct stat stbuf;
+    time_t expires;
+};
+static mutex leaseMutex;
+static map<string, LeasedAttrs> leased;
+static uint64_t leaseGeneration = 0;    // incremented with each invalidation
+
+static uint64_t lease_generation() {
+    lock_guard<mutex> lock(leaseMutex);
+    return leaseGeneration;
+}
+
+static bool use_leased(const char *path, int &res, struct stat *stbuf) {
+    lock_guard<mutex> lock(leaseMutex);
+    auto it = leased.find(path);
+    if (it == leased.end())
+        return false;
+    if (now() > it->second.expires) {
+        leased.erase(it);
+        return false;
+    }
+    res = it->second.res;
+    *stbuf = it->second.stbuf;
+    return true;
+}
+
+static void store_leased(const char *path, int res, const struct stat &stbuf,
+                         uint32_t lease, uint64_t generation) {
+    lock_guard<mutex> lock(leaseMutex);
+    if (generation != leaseGeneration)
+        return;
+    // (now() is rounded down, so the lease may have begun up to a
+    // second earlier)
+    LeasedAttrs &la = leased[path];
+    la.res = res;
+    la.stbuf = stbuf;
+    la.expires = now() + lease - 1;
+}
+
+// Manifests of trees leased by erlent-server (see ManifestRequest),
+// fetched by the FUSE process before it mounts the file system (the
+// replies to requests sent earlier would be received by the parent
+// process, see RemoteRequestProcessor): lookups below their roots
+// are answered from them until the lease ends or is revoked, or until
+// anything in the tree is modified through the file system.
+struct ManifestEntry {
+    struct stat stbuf;
+    string target;
+    bool listed;
+    vector<string> names;   // of a listed directory
+    time_t expires;
+};
+static vector<string> manifestsWanted;
+static mutex manifestMutex;
+static map<string, ManifestEntry> manifest;
+static vector<string> manifestRoots;
+
+static string parent_of(const string &path) {
+    size_t pos = path.rfind('/');
+    return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+// whether 'path' is 'dir' or below it
+static bool is_below(const string &path, const string &dir) {
+    return dir == "/" || path == dir
+        || (path.compare(0, dir.size(), dir) == 0 && path[dir.size()] == '/');
+}
+
+void erlent_add_manifest(const string &root) {
+    manifestsWanted.push_back(root);
+}
+
+static void load_manifest(const string &root) {
+    uint64_t generation = lease_generation();
+    ManifestRequest req(root.c_str());
+    int res = reqproc->process(req);
+    ManifestReply &repl = req.getReply();
+    if (res < 0 || repl.getLease() == 0) {
+        dbg() << "No manifest of '" << root << "': " << repl.getResultMessage() << endl;
+        return;
+    }
+    lock_guard<mutex> lock(manifestMutex);
+    if (generation != lease_generation())
+        return;
+    time_t expires = now() + repl.getLease() - 1;
+    for (ManifestReply::Entry &e : repl.getEntries()) {
+        string path = e.name.empty() ? root : (root == "/" ? root : root + "/") + e.name;
+        ManifestEntry &me = manifest[path];
+        me.stbuf = e.stbuf;
+        me.target.swap(e.target);
+        me.listed = (e.flags & ManifestReply::LISTED) != 0;
+        me.expires = expires;
+        if (!e.name.empty())
+            manifest[parent_of(path)].names.push_back(path.substr(path.rfind('/') + 1));
+    }
+    manifestRoots.push_back(root);
+    dbg() << "Manifest of '" << root << "' with " << repl.getEntries().size() << " entries" << endl;
+}
+
+// The valid manifest entry of 'path' or, with 'parent' set, of the
+// listed directory containing it (called with manifestMutex locked).
+static const ManifestEntry *find_manifest(const string &path, bool parent) {
+    auto it = manifest.find(parent ? parent_of(path) : path);
+    if (it == manifest.end() || now() > it->second.expires)
+        return nullptr;
+    if (parent && !it->second.listed)
+        return nullptr;
+    return &it->second;
+}
+
+static bool use_manifest(const char *path, int &res, struct stat *stbuf) {
+    if (!reqproc->isRemote(path))
+        return false;
+    lock_guard<mutex> lock(manifestMutex);
+    if (manifest.empty())
+        return false;
+    const ManifestEntry *me = find_manifest(path, false);
+    if (me != nullptr && (me->listed || !S_ISDIR(me->stbuf.st_mode))) {
+        res = 0;
+        *stbuf = me->stbuf;
+        return true;
+    }
+    // not in the listing of its directory
+    if (me == nullptr && strcmp(path, "/") != 0 && find_manifest(path, true) != nullptr) {
+        res = -ENOENT;
+        return true;
+    }
+    return false;
+}
+
+static bool use_manifest_listing(const char *path, vector<pair<string, struct stat> > &entries) {
+    if (!reqproc->isRemote(path))
+        return false;
+    lock_guard<mutex> lock(manifestMutex);
+    if (manifest.empty())
+        return false;
+    const ManifestEntry *me = find_manifest(path, false);
+    if (me == nullptr || !me->listed)
+        return false;
+    string dir = path;
+    if (*dir.rbegin() != '/')
+        dir += '/';
+    for (const string &name : me->names)
+        entries.push_back(make_pair(name, manifest[dir + name].stbuf));
+    return true;
+}
+
+static bool use_manifest_link(const char *path, string &target) {
+    if (!reqproc->isRemote(path))
+        return false;
+    lock_guard<mutex> lock(manifestMutex);
+    if (manifest.empty())
+        return false;
+    const ManifestEntry *me = find_manifest(path, false);
+    if (me == nullptr || !S_ISLNK(me->stbuf.st_mode))
+        return false;
+    target = me->target;
+    return true;
+}
+
+// Drop the manifests of the trees 'path' belongs to or contains.
+static void drop_manifest(const string &path) {
+    lock_guard<mutex> lock(manifestMutex);
+    for (auto r = manifestRoots.begin(); r != manifestRoots.end(); ) {
+        if (!is_below(path, *r) && !is_below(*r, path)) {
+            ++r;
+            continue;
+        }
+        dbg() << "Dropping the manifest of '" << *r << "'" << endl;
+        for (auto it = manifest.lower_bound(*r); it != manifest.end() && is_below(it->first, *r); )
+            it = manifest.erase(it);
+        r = manifestRoots.erase(r);
+    }
+}
+
+static void drop_read_ahead(const string &path, bool below);
+
+void erlent_revoke_lease(const string &path) {
+    BlockCache::invalidate(path);
+    drop_read_ahead(path, false);
+    drop_manifest(path);
+    lock_guard<mutex> lock(leaseMutex);
+    ++leaseGeneration;
+    leased.erase(path);
+}
+
+// 'path' has been modified through the file system: this changes the
+// attributes of its parent directory as well, and those of everything
+// below it when a directory is renamed or removed.
+static void forget_attrs(const char *path) {
+    forget_prefetched();
+    BlockCache::discard(path);
+    drop_read_ahead(path, true);
+    drop_manifest(path);
+
+    string p = path;
+    string parent = p.substr(0, p.rfind('/'));
+    if (parent.empty())
+        parent = "/";
+    lock_guard<mutex> lock(leaseMutex);
+    ++leaseGeneration;
+    leased.erase(p);
+    leased.erase(parent);
+    string prefix = p == "/" ? p : p + "/";
+    auto it = leased.lower_bound(prefix);
+    while (it != leased.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+        it = leased.erase(it);
+}
+
+// Write-back of small writes (when enabled with
+// erlent_enable_write_back()): adjacent writes to a file opened for
+// writing are collected in a buffer of the open file and sent as one
+// WRITE when a write does not continue them or does not fit, when the
+// file is flushed, synced or released, when its path is used by
+// another operation, or WRITEBACK_DELAY_MS after the first of them.
+// The error of a WRITE sent this way is returned by the next write,
+// flush or fsync of the open file.
+static const size_t WRITEBACK_SIZE = 1024 * 1024;
+static const int WRITEBACK_DELAY_MS = 500;
+static bool writeBackEnabled = false;
+
+struct WriteBack {
+    mutex m;                // protects the members below
+    string path;
+    off_t offset;
+    Buffer buffer;
+    size_t len;             // 0 if nothing is buffered
+    int error;
+    chrono::steady_clock::time_point since;
+
+    WriteBack() : offset(0), len(0), error(0) { }
+};
+
+static mutex writeBackMutex;
+static multimap<string, shared_ptr<WriteBack> > pendingWrites;  // buffers with data
+static once_flag flusherStarted;
+
+void erlent_enable_write_back() {
+    writeBackEnabled = true;
+}
+
+// Send the data buffered in 'wb' (locked by the caller).
+static void send_buffered(WriteBack &wb) {
+    if (wb.len == 0)
+        return;
+    WriteRequest req(wb.path.c_str(), wb.buffer.get(), wb.len, wb.offset);
+    int res = reqproc->process(req);
+    if (wb.error == 0 && res < 0)
+        wb.error = res;
+    else if (wb.error == 0 && (size_t)res < wb.len)
+        wb.error = -EIO;
+    {
+        lock_guard<mutex> lock(writeBackMutex);
+        auto range = pendingWrites.equal_range(wb.path);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.get() == &wb) {
+                pendingWrites.erase(it);
+                break;
+            }
+        }
+    }
+    wb.len = 0;
+    wb.buffer.release();
+    forget_attrs(wb.path.c_str());
+}
+
+static int take_error(WriteBack &wb) {
+    int err = wb.error;
+    wb.error = 0;
+    return err;
+}
+
+// Send the writes buffered for 'path' (and for the files below it if
+// 'below' is set), except those in 'except'.
+static void flush_pending(const char *path, bool below = false, const WriteBack *except = nullptr) {
+    vector<shared_ptr<WriteBack> > wbs;
+    {
+        lock_guard<mutex> lock(writeBackMutex);
+        if (pendingWrites.empty())
+            return;
+        string p = path;
+        auto range = pendingWrites.equal_range(p);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.get() != except)
+                wbs.push_back(it->second);
+        }
+        if (below) {
+            string prefix = p == "/" ? p : p + "/";
+            auto it = pendingWrites.lower_bound(prefix);
+            for (; it != pendingWrites.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                if (it->second.get() != except)
+                    wbs.push_back(it->second);
+            }
+        }
+    }
+    for (auto &wb : wbs) {
+        lock_guard<mutex> lock(wb->m);
+        send_buffered(*wb);
+    }
+}
+
+static void flush_periodically() {
+    for (;;) {
+        this_thread::sleep_for(chrono::milliseconds(WRITEBACK_DELAY_MS / 2));
+        auto limit = chrono::steady_clock::now() - chrono::milliseconds(WRITEBACK_DELAY_MS);
+        vector<shared_ptr<WriteBack> > wbs;
+        {
+            lock_guard<mutex> lock(writeBackMutex);
+            for (auto &pw : pendingWrites)
+                wbs.push_back(pw.second);
+        }
+        for (auto &wb : wbs) {
+            lock_guard<mutex> lock(wb->m);
+            if (wb->since <= limit)
+                send_buffered(*wb);
+        }
+    }
+}
+
+static int write_back(const char *path, const char *data, size_t size, off_t offset,
+                      const shared_ptr<WriteBack> &wbp) {
+    WriteBack &wb = *wbp;
+    // (writes to the file through other open files come first)
+    flush_pending(path, false, &wb);
+    lock_guard<mutex> lock(wb.m);
+    if (wb.len > 0 && (wb.path != path || offset != wb.offset + (off_t)wb.len
+                       || wb.len + size > WRITEBACK_SIZE))
+        send_buffered(wb);
+    int err = take_error(wb);
+    if (err != 0)
+        return err;
+    if (size >= WRITEBACK_SIZE) {
+        WriteRequest req(path, data, size, offset);
+        int res = reqproc->process(req);
+        forget_attrs(path);
+        return res;
+    }
+    if (wb.len == 0) {
+        call_once(flusherStarted, []() { thread(flush_periodically).detach(); });
+        wb.path = path;
+        wb.offset = offset;
+        wb.buffer.reset(WRITEBACK_SIZE);
+        wb.since = chrono::steady_clock::now();
+        lock_guard<mutex> lock(writeBackMutex);
+        pendingWrites.insert(make_pair(wb.path, wbp));
+    }
+    memcpy(wb.buffer.get() + wb.len, data, size);
+    wb.len += size;
+    forget_attrs(path);
+    return size;
+}
+
+// Read-ahead for files opened read-only (when enabled with
+// erlent_enable_read_ahead()): while a file is read sequentially, the
+// READs sent for it fetch a window of data beyond the range asked for,
+// starting with READAHEAD_MIN bytes and doubling up to the maximum.
+// While one window is read, the next one is fetched in the background
+// by one of READAHEAD_FETCHERS threads (started when the first window
+// is fetched). A read elsewhere drops the windows, and so does a change
+// of the file.
+static const size_t READAHEAD_MIN = 256 * 1024;
+static const unsigned READAHEAD_FETCHERS = 4;
+static size_t readAheadMax = 0;
+
+struct ReadAhead {
+    const string path;
+    atomic<bool> stale;     // the file has changed
+    mutex m;                // protects the members below
+    condition_variable cv;
+    off_t next;             // where a sequential read continues
+    size_t window;          // size of the next window, 0 if not sequential
+    Buffer current, ahead;  // the window being read and the next one
+    off_t curOffset, aheadOffset;
+    size_t curLen, aheadLen;
+    bool fetching;          // the next window is being fetched
+    unsigned epoch;         // incremented when the windows are dropped
+    off_t eof;              // where a window ended early, or -1
+
+    explicit ReadAhead(const char *path)
+        : path(path), stale(false), next(0), window(0), curOffset(0), aheadOffset(0),
+          curLen(0), aheadLen(0), fetching(false), epoch(0), eof(-1) { }
+};
+
+static mutex readAheadMutex;
+static set<ReadAhead *> readingAhead;
+
+// a window to be fetched by the fetcher threads
+struct Fetch {
+    shared_ptr<ReadAhead> ra;
+    off_t offset;
+    size_t len;
+    unsigned epoch;         // of the windows it belongs to
+};
+
+// (never destroyed, the fetcher threads wait on it until the process
+// exits)
+struct FetchQueue {
+    mutex m;
+    condition_variable cv;
+    deque<Fetch> fetches;
+};
+
+static FetchQueue *fetchQueue = nullptr;
+static once_flag fetchersStarted;
+
+void erlent_enable_read_ahead(size_t maxBytes) {
+    readAheadMax = maxBytes;
+}
+
+static void drop_read_ahead(const string &path, bool below) {
+    lock_guard<mutex> lock(readAheadMutex);
+    string prefix = path == "/" ? path : path + "/";
+    for (ReadAhead *ra : readingAhead) {
+        if (ra->path == path || (below && ra->path.compare(0, prefix.size(), prefix) == 0))
+            ra->stale = true;
+    }
+}
+
+// (called with ra.m locked)
+static void drop_windows(ReadAhead &ra) {
+    ra.current.release();
+    ra.ahead.release();
+    ra.curLen = ra.aheadLen = 0;
+    ra.eof = -1;
+    ++ra.epoch;
+}
+
+static void fetch_windows() {
+    for (;;) {
+        Fetch f;
+        {
+            FetchQueue &q = *fetchQueue;
+            unique_lock<mutex> lock(q.m);
+            q.cv.wait(lock, [&q]() { return !q.fetches.empty(); });
+            f = q.fetches.front();
+            q.fetches.pop_front();
+        }
+        ReadAhead &ra = *f.ra;
+        Buffer data(f.len);
+        int res = -ECANCELED;
+        bool wanted;
+        {
+            lock_guard<mutex> lock(ra.m);
+            wanted = f.epoch == ra.epoch && !ra.stale;
+        }
+        if (wanted) {
+            ReadRequest req(ra.path.c_str(), f.len, f.offset);
+            req.getReply().init(data.get(), f.len);
+            res = reqproc->process(req);
+        }
+        lock_guard<mutex> lock(ra.m);
+        ra.fetching = false;
+        ra.cv.notify_all();
+        // (errors are reported when the data is read synchronously)
+        if (res < 0 || f.epoch != ra.epoch)
+            continue;
+        ra.ahead.swap(data);
+        ra.aheadOffset = f.offset;
+        ra.aheadLen = res;
+        if ((size_t)res < f.len)
+            ra.eof = f.offset + res;
+    }
+}
+
+// Have the window following the current one fetched in the background
+// (called with ra.m locked).
+static void fetch_ahead(const shared_ptr<ReadAhead> &rap) {
+    ReadAhead &ra = *rap;
+    off_t offset = ra.curOffset + ra.curLen;
+    if (ra.window == 0 || ra.fetching || ra.aheadLen > 0 || ra.curLen == 0
+        || (ra.eof != -1 && offset >= ra.eof))
+        return;
+    size_t len = ra.window;
+    ra.window = min(ra.window * 2, readAheadMax);
+    ra.fetching = true;
+    call_once(fetchersStarted, []() {
+        fetchQueue = new FetchQueue();
+        for (unsigned i=0; i<READAHEAD_FETCHERS; ++i)
+            thread(fetch_windows).detach();
+    });
+    lock_guard<mutex> lock(fetchQueue->m);
+    fetchQueue->fetches.push_back(Fetch{rap, offset, len, ra.epoch});
+    fetchQueue->cv.notify_one();
+}
+
+static int read_ahead(const char *path, char *buf, size_t size, off_t offset,
+                      const shared_ptr<ReadAhead> &rap)
+{
+    ReadAhead &ra = *rap;
+    unique_lock<mutex> lock(ra.m);
+    if (ra.stale.exchange(false))
+        drop_windows(ra);
+    bool buffered = (offset >= ra.curOffset && offset < ra.curOffset + (off_t)ra.curLen)
+        || (offset >= ra.aheadOffset && offset < ra.aheadOffset + (off_t)ra.aheadLen);
+    // (the kernel may send the reads of several threads out of order)
+    bool sequential = offset >= ra.next - (off_t)READAHEAD_MIN
+        && offset <= ra.next + (off_t)READAHEAD_MIN;
+    if (!buffered && !sequential) {
+        drop_windows(ra);
+        ra.window = 0;
+        ra.next = offset;
+    } else if (ra.window == 0 && offset > 0)
+        ra.window = min(READAHEAD_MIN, readAheadMax);
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        off_t curEnd = ra.curOffset + ra.curLen;
+        if (pos >= ra.curOffset && pos < curEnd) {
+            size_t n = min(size - done, (size_t)(curEnd - pos));
+            memcpy(buf + done, ra.current.get() + (pos - ra.curOffset), n);
+            done += n;
+        } else if (ra.aheadLen > 0 && pos >= ra.aheadOffset
+                   && pos < ra.aheadOffset + (off_t)ra.aheadLen) {
+            ra.current.swap(ra.ahead);
+            ra.ahead.release();
+            ra.curOffset = ra.aheadOffset;
+            ra.curLen = ra.aheadLen;
+            ra.aheadLen = 0;
+        } else if (ra.eof != -1 && pos >= ra.eof) {
+            break;
+        } else if (ra.fetching && ra.curLen > 0 && pos == curEnd) {
+            ra.cv.wait(lock);
+        } else if (ra.window == 0) {
+            // (other reads of the file go on meanwhile)
+            lock.unlock();
+            ReadRequest req(path, size - done, pos);
+            req.getReply().init(buf + done, size - done);
+            int res = reqproc->process(req);
+            lock.lock();
+            if (res < 0)
+                return done > 0 ? done : res;
+            done += res;
+            break;
+        } else {
+            size_t len = max(size - done, ra.window);
+            unsigned epoch = ra.epoch;
+            lock.unlock();
+            Buffer data(len);
+            ReadRequest req(path, len, pos);
+            req.getReply().init(data.get(), len);
+            int res = reqproc->process(req);
+            lock.lock();
+            if (res < 0)
+                return done > 0 ? done : res;
+            size_t n = min(size - done, (size_t)res);
+            memcpy(buf + done, data.get(), n);
+            done += n;
+            // (unless the windows have been dropped meanwhile)
+            if (epoch == ra.epoch && !ra.stale) {
+                drop_windows(ra);
+                ra.current.swap(data);
+                ra.curOffset = pos;
+                ra.curLen = res;
+                if ((size_t)res < len)
+                    ra.eof = pos + res;
+            }
+            if ((size_t)res < len)
+                break;
+        }
+    }
+    ra.next = max(ra.next, (off_t)(offset + done));
+    fetch_ahead(rap);
+    return done;
+}
+
 static int erlent_getattr(const char *path, struct stat *stbuf) {
     dbg() << "erlent_getattr on '" << path << "'" << endl;
+    int res;
+    flush_pending(path);
+    if (use_manifest(path, res, stbuf))
+        return res;
+    if (use_prefetched(path, stbuf))
+        return 0;
+    if (use_leased(path, res, stbuf))
+        return res;
+    uint64_t generation = lease_generation();
     GetattrRequest req(path);
-    req.getReply().init(stbuf);
-    return reqproc->process(req);
+    GetattrReply &repl = req.getReply();
+    repl.init(stbuf);
+    // a symbolic link is read right after its attributes, so ask for
+    // its target in the same round trip (this fails for other files)
+    ReadlinkRequest linkReq(path);
+    CompoundRequest creq;
+    creq.add(req);
+    creq.add(linkReq);
+    reqproc->process(creq);
+    res = repl.getResult();
+    if (repl.getLease() > 0)
+        store_leased(path, res, *stbuf, repl.getLease(), generation);
+    if (res == 0 && S_ISLNK(stbuf->st_mode) && linkReq.getReply().getResult() == 0) {
+        lock_guard<mutex> lock(prefetchMutex);
+        prefetchedLinks[path] = make_pair(linkReq.getReply().getTarget(), now());
+    }
+    return res;
 }
 
+// Directories are listed in pages of READDIR_PAGE entries; the cookie
+// of each entry is passed to FUSE as its offset, so that a listing
+// interrupted by a full buffer continues after the last entry filled.
+static const uint32_t READDIR_PAGE = 256;
+
 static int erlent_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi)
 {
-    dbg() << "erlent_readdir '" << path << "'" << endl;
-    (void) offset;
+    dbg() << "erlent_readdir '" << path << "' at " << offset << endl;
     (void) fi;
 
-    ReaddirRequest req(path);
-    int res = reqproc->process(req);
-    ReaddirReply &rr = req.getReply();
-    if (res == 0) {
-        ReaddirReply::name_iterator end = rr.names_end(), it;
-        for (it=rr.names_begin(); it != end; ++it) {
-            filler(buf, (*it).c_str(), NULL, 0);
-        }
+    // (the attributes of the entries are returned)
+    flush_pending(path, true);
+    vector<pair<string, struct stat> > entries;
+    if (offset == 0 && use_manifest_listing(path, entries)) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (auto &e : entries)
+            filler(buf, e.first.c_str(), &e.second, 0);
+        return 0;
     }
+    string dir = path;
+    if (*dir.rbegin() != '/')
+        dir += '/';
+    uint64_t cookie = offset;
+    do {
+        ReaddirplusRequest req(path, cookie, READDIR_PAGE);
+        int res = reqproc->process(req);
+        if (res != 0)
+            return res;
+        ReaddirplusReply &rr = req.getReply();
+        time_t t = now();
+        {
+            lock_guard<mutex> lock(prefetchMutex);
+            for (auto it = prefetched.begin(); it != prefetched.end(); ) {
+                if (t - it->second.second > PREFETCH_TIMEOUT)
+                    it = prefetched.erase(it);
+                else
+                    ++it;
+            }
+            ReaddirplusReply::entry_iterator end = rr.entries_end(), it;
+            for (it=rr.entries_begin(); it != end; ++it) {
+                if (it->stbuf.st_mode != 0 && it->name != "." && it->name != "..")
+                    prefetched[dir + it->name] = make_pair(it->stbuf, t);
+            }
+        }
+        ReaddirplusReply::entry_iterator end = rr.entries_end(), it;
+        for (it=rr.entries_begin(); it != end; ++it) {
+            if (filler(buf, it->name.c_str(), it->stbuf.st_mode != 0 ? &it->stbuf : NULL,
+                       (off_t)it->cookie) != 0)
+                return 0;
+        }
+        cookie = rr.getCookie();
+    } while (cookie != 0);
 
-    return res;
+    return 0;
 }
 
 static int erlent_readlink(const char *path, char *result, size_t size) {
     dbg() << "erlent_readlink for '" << path << "'." << endl;
+    string target;
+    if (use_manifest_link(path, target) || use_prefetched_link(path, target)) {
+        strncpy(result, target.c_str(), size);
+        return 0;
+    }
     ReadlinkRequest req(path);
     int res = reqproc->process(req);
     if (res == 0) {
@@ -65,18 +766,178 @@ static int erlent_readlink(const char *path, char *result, size_t size) {
     return res;
 }
 
+// What is kept in fi->fh for an open file (0 if there is nothing):
+// the file descriptor passed by erlent-server with the OPEN reply (the
+// file is then read and written directly), or the file's contents in
+// the block cache or its read-ahead windows (when it is opened
+// read-only), or the buffer for write-back (when it is opened for
+// writing).
+struct OpenFile {
+    int fd;
+    BlockCache::File *cache;
+    shared_ptr<WriteBack> writeBack;
+    shared_ptr<ReadAhead> readAhead;
+};
+
+static OpenFile *open_file(const struct fuse_file_info *fi) {
+    return (OpenFile *)(uintptr_t)fi->fh;
+}
+
+// Files opened read-only are opened with a compound request that gets
+// their attributes (for the block cache) as well, and their first
+// OPEN_READ_SIZE bytes when they are read ahead: a small file is then
+// opened and read in one round trip.
+static const size_t OPEN_READ_SIZE = BlockCache::BLOCK_SIZE;
+
 static int erlent_open(const char *path, struct fuse_file_info *fi)
 {
     dbg() << "erlent_open for '" << path << "' with flags=0" << fi->flags << "." << endl;
+    flush_pending(path);
+    bool readOnly = (fi->flags & O_ACCMODE) == O_RDONLY;
+    bool remote = reqproc->isRemote(path);
     OpenRequest req(path, fi->flags);
     req.setMode(0);
-    return reqproc->process(req);
+    int res;
+    struct stat stbuf;
+    int attrRes = -1;
+    Buffer head;
+    int headLen = -1;
+    if (readOnly && remote && (BlockCache::isEnabled() || readAheadMax > 0)) {
+        // (the block cache reads whole blocks itself, and a passed
+        // file descriptor is read directly)
+        bool readHead = !BlockCache::isEnabled()
+            && (GlobalOptions::getFeatures() & FEATURE_FD_PASSING) == 0;
+        uint64_t generation = lease_generation();
+        GetattrRequest attrReq(path);
+        attrReq.getReply().init(&stbuf);
+        ReadRequest readReq(path, OPEN_READ_SIZE, 0);
+        CompoundRequest creq;
+        creq.add(attrReq);
+        creq.add(req);
+        if (readHead) {
+            head.reset(OPEN_READ_SIZE);
+            readReq.getReply().init(head.get(), OPEN_READ_SIZE);
+            creq.add(readReq);
+        }
+        reqproc->process(creq);
+        attrRes = attrReq.getReply().getResult();
+        if (attrReq.getReply().getLease() > 0)
+            store_leased(path, attrRes, stbuf, attrReq.getReply().getLease(), generation);
+        res = attrRes < 0 ? attrRes : req.getReply().getResult();
+        if (readHead && res == 0 && readReq.getReply().getResult() >= 0)
+            headLen = readReq.getReply().getResult();
+    } else
+        res = reqproc->process(req);
+    int fd = req.getReply().takeFd();
+    BlockCache::File *cache = nullptr;
+    if (res == 0 && fd == -1 && readOnly && remote && BlockCache::isEnabled() && attrRes == 0)
+        cache = BlockCache::open(path, stbuf);
+    shared_ptr<WriteBack> writeBack;
+    if (res == 0 && fd == -1 && !readOnly && remote && writeBackEnabled)
+        writeBack = make_shared<WriteBack>();
+    shared_ptr<ReadAhead> readAhead;
+    if (res == 0 && fd == -1 && readOnly && remote && cache == nullptr && readAheadMax > 0) {
+        readAhead = make_shared<ReadAhead>(path);
+        if (headLen >= 0) {
+            // (the first window)
+            readAhead->current.swap(head);
+            readAhead->curLen = headLen;
+            if ((size_t)headLen < OPEN_READ_SIZE)
+                readAhead->eof = headLen;
+        }
+        lock_guard<mutex> lock(readAheadMutex);
+        readingAhead.insert(readAhead.get());
+    }
+    if (fd != -1 || cache != nullptr || writeBack || readAhead)
+        fi->fh = (uintptr_t)new OpenFile{fd, cache, writeBack, readAhead};
+    return res;
+}
+
+static int erlent_release(const char *path, struct fuse_file_info *fi)
+{
+    OpenFile *of = open_file(fi);
+    if (of == nullptr)
+        return 0;
+    if (of->writeBack) {
+        lock_guard<mutex> lock(of->writeBack->m);
+        send_buffered(*of->writeBack);
+    }
+    if (of->fd != -1)
+        close(of->fd);
+    if (of->cache != nullptr)
+        BlockCache::close(of->cache);
+    if (of->readAhead) {
+        lock_guard<mutex> lock(readAheadMutex);
+        readingAhead.erase(of->readAhead.get());
+    }
+    delete of;
+    return 0;
+}
+
+// Blocks cached for an older version of the file are compared with
+// the checksums of the current one when they are first read, in runs
+// of up to VERIFY_BLOCKS blocks, so that only the blocks that have
+// changed are read again.
+static const size_t VERIFY_BLOCKS = 64;
+
+static void verify_cached(const char *path, BlockCache::File *cache, size_t size, off_t offset)
+{
+    const size_t bs = BlockCache::BLOCK_SIZE;
+    size_t max = min(min(VERIFY_BLOCKS, (size_t)ChecksumsRequest::MAX_BLOCKS),
+                     (size_t)ChecksumsRequest::MAX_BYTES / bs);
+    off_t runOffset;
+    size_t count = BlockCache::unverified(cache, offset, size, max, runOffset);
+    if (count == 0)
+        return;
+    ChecksumsRequest req(path, runOffset, bs, count);
+    int res = reqproc->process(req);
+    BlockCache::verify(cache, runOffset, count,
+                       res == 0 ? req.getReply().getSums() : vector<string>());
+}
+
+// Read whole blocks from erlent-server, so that they can be cached.
+static int read_cached(const char *path, char *buf, size_t size, off_t offset,
+                       BlockCache::File *cache)
+{
+    ssize_t n = BlockCache::read(cache, buf, size, offset);
+    if (n >= 0)
+        return n;
+    verify_cached(path, cache, size, offset);
+    n = BlockCache::read(cache, buf, size, offset);
+    if (n >= 0)
+        return n;
+    const size_t bs = BlockCache::BLOCK_SIZE;
+    off_t start = offset - offset % bs;
+    size_t len = (offset + size - start + bs - 1) / bs * bs;
+    Buffer data(len);
+    ReadRequest req(path, len, start);
+    req.getReply().init(data.get(), len);
+    int res = reqproc->process(req);
+    if (res < 0)
+        return res;
+    BlockCache::store(cache, data.get(), len, res, start);
+    size_t skip = offset - start;
+    if ((size_t)res <= skip)
+        return 0;
+    n = min(size, res - skip);
+    memcpy(buf, data.get() + skip, n);
+    return n;
 }
 
 static int erlent_read(const char *path, char *buf, size_t size, off_t offset,
                        struct fuse_file_info *fi)
 {
     dbg() << "erlent_read '" << path << "'." << endl;
+    flush_pending(path);
+    OpenFile *of = open_file(fi);
+    if (of != nullptr && of->fd != -1) {
+        ssize_t res = pread(of->fd, buf, size, offset);
+        return res == -1 ? -errno : res;
+    }
+    if (of != nullptr && of->cache != nullptr)
+        return read_cached(path, buf, size, offset, of->cache);
+    if (of != nullptr && of->readAhead && of->readAhead->path == path)
+        return read_ahead(path, buf, size, offset, of->readAhead);
     ReadRequest req(path, size, offset);
     req.getReply().init(buf, size);
     return reqproc->process(req);
@@ -86,8 +947,21 @@ static int erlent_write(const char *path, const char *data, size_t size, off_t o
                         struct fuse_file_info *fi)
 {
     dbg() << "erlent_write '" << path << "'." << endl;
+    OpenFile *of = open_file(fi);
+    if (of != nullptr && of->writeBack)
+        return write_back(path, data, size, offset, of->writeBack);
+    flush_pending(path);
+    if (of != nullptr && of->fd != -1) {
+        ssize_t res = pwrite(of->fd, data, size, offset);
+        if (res == -1)
+            res = -errno;
+        forget_attrs(path);
+        return res;
+    }
     WriteRequest req(path, data, size, offset);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_access(const char *path, int perms) {
@@ -98,23 +972,32 @@ static int erlent_access(const char *path, int perms) {
 
 static int erlent_truncate(const char *path, off_t size) {
     dbg() << "erlent_truncate '" << path << "'." << endl;
+    flush_pending(path);
     TruncateRequest req(path, size);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_chmod(const char *path, mode_t mode) {
     dbg() << "erlent_chmod '" << path << "', mode " << hex << mode << endl;
+    flush_pending(path);
     ChmodRequest req(path, mode);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_chown(const char *path, uid_t uid, gid_t gid) {
     dbg() << "erlent_chown '" << path << "' " << dec << uid
           << ':' << dec << gid << endl;
+    flush_pending(path);
     ChownRequest req(path);
     req.setUid(uid);
     req.setGid(gid);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_mkdir(const char *path, mode_t mode) {
@@ -123,31 +1006,47 @@ static int erlent_mkdir(const char *path, mode_t mode) {
     struct fuse_context *ctx = fuse_get_context();
     req.setUid(ctx->uid);
     req.setGid(ctx->gid);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_unlink(const char *path) {
     dbg() << "erlent_unlink '" << path << "'." << endl;
+    flush_pending(path);
     UnlinkRequest req(path);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_rename(const char *from, const char *to) {
     dbg() << "erlent_rename '" << from << "' -> '" << to << "'." << endl;
+    flush_pending(from, true);
+    flush_pending(to, true);
     RenameRequest req(from, to);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(from);
+    forget_attrs(to);
+    return res;
 }
 
 static int erlent_rmdir(const char *path) {
     dbg() << "erlent_rmdir '" << path << "'." << endl;
+    flush_pending(path, true);
     RmdirRequest req(path);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_utimens(const char *path, const struct timespec tv[2]) {
     dbg() << "erlent_utimens '" << path << "'." << endl;
+    flush_pending(path);
     UtimensRequest req(path, tv);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_create(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -158,7 +1057,11 @@ static int erlent_create(const char *path, mode_t mode, struct fuse_file_info *f
     struct fuse_context *ctx = fuse_get_context();
     req.setUid(ctx->uid);
     req.setGid(ctx->gid);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    if (res == 0 && writeBackEnabled && reqproc->isRemote(path))
+        fi->fh = (uintptr_t)new OpenFile{-1, nullptr, make_shared<WriteBack>()};
+    return res;
 }
 
 static int erlent_mknod(const char *path, mode_t mode, dev_t dev)
@@ -169,7 +1072,9 @@ static int erlent_mknod(const char *path, mode_t mode, dev_t dev)
     struct fuse_context *ctx = fuse_get_context();
     req.setUid(ctx->uid);
     req.setGid(ctx->gid);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(path);
+    return res;
 }
 
 static int erlent_symlink(const char *from, const char *to) {
@@ -178,13 +1083,19 @@ static int erlent_symlink(const char *from, const char *to) {
     struct fuse_context *ctx = fuse_get_context();
     req.setUid(ctx->uid);
     req.setGid(ctx->gid);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(to);
+    return res;
 }
 
 static int erlent_link(const char *from, const char *to) {
     dbg() << "erlent_link '" << from << "' -> '" << to << "'." << endl;
+    flush_pending(from);
     LinkRequest req(from, to);
-    return reqproc->process(req);
+    int res = reqproc->process(req);
+    forget_attrs(from);
+    forget_attrs(to);
+    return res;
 }
 
 static int erlent_statfs(const char *path, struct statvfs *buf) {
@@ -196,7 +1107,17 @@ static int erlent_statfs(const char *path, struct statvfs *buf) {
 
 static int erlent_flush(const char *path, struct fuse_file_info *fi)
 {
-    return 0;
+    OpenFile *of = open_file(fi);
+    if (of == nullptr || !of->writeBack)
+        return 0;
+    lock_guard<mutex> lock(of->writeBack->m);
+    send_buffered(*of->writeBack);
+    return take_error(*of->writeBack);
+}
+
+static int erlent_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return erlent_flush(path, fi);
 }
 
 
@@ -292,7 +1213,7 @@ static void endsig_hdl(int signum)
     fuse_session_exit(fuse_instance);
 }
 
-pid_t erlent_fuse(pid_t child_pid, RequestProcessor &rp)
+pid_t erlent_fuse(pid_t child_pid, RequestProcessor &rp, bool multithreaded)
 {
     ::child_pid = child_pid;
     reqproc = &rp;
@@ -321,6 +1242,7 @@ pid_t erlent_fuse(pid_t child_pid, RequestProcessor &rp)
     erlent_oper.readlink = erlent_readlink;
     erlent_oper.readdir = erlent_readdir;
     erlent_oper.open = erlent_open;
+    erlent_oper.release = erlent_release;
     erlent_oper.read = erlent_read;
     erlent_oper.write = erlent_write;
     erlent_oper.create = erlent_create;
@@ -337,6 +1259,7 @@ pid_t erlent_fuse(pid_t child_pid, RequestProcessor &rp)
     erlent_oper.rmdir    = erlent_rmdir;
     erlent_oper.utimens  = erlent_utimens;
     erlent_oper.flush    = erlent_flush;
+    erlent_oper.fsync    = erlent_fsync;
     erlent_oper.statfs   = erlent_statfs;
     erlent_oper.init     = erlent_init;
 
@@ -359,21 +1282,25 @@ pid_t erlent_fuse(pid_t child_pid, RequestProcessor &rp)
             sigaddset(&sigset, sig);
         sigprocmask(SIG_BLOCK, &sigset, NULL);
 
-        char *fuse_args[] = {
-            strdup("erlent-fuse"), strdup("-f"), strdup("-s"),
+        for (const string &root : manifestsWanted)
+            load_manifest(root);
+
+        vector<char *> fuse_args = {
+            strdup("erlent-fuse"), strdup("-f"),
             strdup("-o"), strdup("auto_unmount"),
             strdup("-o"), strdup("allow_other"),
             strdup("-o"), strdup("default_permissions"),
             strdup(newroot.c_str())
         };
-        int fuse_argc = sizeof(fuse_args)/sizeof(*fuse_args);
+        if (!multithreaded)
+            fuse_args.push_back(strdup("-s"));
 
         int fuse_err;
 
         int multi;
         char *mountpt;
         struct fuse *fuse;
-        fuse = fuse_setup(fuse_argc, fuse_args, &erlent_oper, sizeof(erlent_oper),
+        fuse = fuse_setup(fuse_args.size(), fuse_args.data(), &erlent_oper, sizeof(erlent_oper),
                           &mountpt, &multi, NULL);
         if (!fuse) {
             cerr << "Could not set up FUSE filesystem" << endl;
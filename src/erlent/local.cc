@@ -31,8 +31,9 @@ void erlent::LocalRequestProcessor::addPathMapping(AttrType attrType, const stri
 
 erlent::LocalRequestProcessor::AttrType erlent::LocalRequestProcessor::getAttrType(const erlent::Request &req) const
 {
-    const RequestWithPathname *rwp = dynamic_cast<const RequestWithPathname *>(&req);
-    return rwp == nullptr ? AttrType::Untranslated : getAttrType(rwp->getPathname());
+    if (typeInfo(req.getMessageType()).pathnames == 0)
+        return AttrType::Untranslated;
+    return getAttrType(static_cast<const RequestWithPathname &>(req).getPathname());
 }
 
 erlent::LocalRequestProcessor::AttrType erlent::LocalRequestProcessor::getAttrType(const string &pathname) const
@@ -73,15 +74,14 @@ static string pathConcat(const string &p1, const string &p2) {
     return p1 + "/" + p2;
 }
 
-void erlent::LocalRequestProcessor::translatePath(Request &req) const {
-    RequestWithPathname *rwp = dynamic_cast<RequestWithPathname *>(&req);
-    if (rwp == nullptr)
+void erlent::LocalRequestProcessor::translatePath(Request &req, const TypeInfo &ti) const {
+    if (ti.pathnames == 0)
         return;
-    const string &pathname = rwp->getPathname();
-    rwp->setPathname(translatePath(pathname));
-    RequestWithTwoPathnames *rw2p = dynamic_cast<RequestWithTwoPathnames *>(&req);
-    if (rw2p != nullptr) {
-        rw2p->setPathname2(translatePath(rw2p->getPathname2()));
+    RequestWithPathname &rwp = static_cast<RequestWithPathname &>(req);
+    rwp.setPathname(translatePath(rwp.getPathname()));
+    if (ti.pathnames == 2) {
+        RequestWithTwoPathnames &rw2p = static_cast<RequestWithTwoPathnames &>(req);
+        rw2p.setPathname2(translatePath(rw2p.getPathname2()));
     }
 }
 
@@ -93,214 +93,340 @@ string erlent::LocalRequestProcessor::translatePath(const string &pathname) cons
     return pathConcat(pp->outsidePath, pathname.substr(pp->insidePath.length()));
 }
 
-static bool needsLock(const erlent::Request &req) {
-    using namespace erlent;
-    switch(req.getMessageType()) {
-    case Message::OPEN:
-    case Message::READ:
-    case Message::READDIR:
-    case Message::READLINK:
-    case Message::STATFS:
-    case Message::TRUNCATE:
-    case Message::WRITE: return false;
-    default: return true;
-    }
+// How requests of each message type are processed; requests that
+// have no handler for their attribute type are simply performed.
+const erlent::LocalRequestProcessor::TypeInfo &erlent::LocalRequestProcessor::typeInfo(Message::Type ty)
+{
+    typedef LocalRequestProcessor L;
+    static const vector<TypeInfo> table = []() {
+        vector<TypeInfo> t(Message::LAST_TYPE - Message::FIRST_TYPE + 1,
+                           TypeInfo{1, true, nullptr, nullptr});
+        auto set = [&t](Message::Type ty) -> TypeInfo & { return t[ty - Message::FIRST_TYPE]; };
+
+        set(Message::HELLO).pathnames    = 0;
+        set(Message::COMPOUND).pathnames = 0;
+        set(Message::LINK).pathnames     = 2;
+        set(Message::RENAME).pathnames   = 2;
+
+        for (Message::Type ty : { Message::OPEN, Message::READ, Message::READDIR,
+                                  Message::READLINK, Message::STATFS,
+                                  Message::TRUNCATE, Message::WRITE,
+                                  Message::MANIFEST, Message::CHECKSUMS })
+            set(ty).lock = false;
+
+        set(Message::OPEN).emulated        = &L::emu_open;
+        set(Message::CHOWN).emulated       = &L::emu_chown;
+        set(Message::CHMOD).emulated       = &L::emu_chmod;
+        set(Message::CREAT).emulated       = &L::emu_creat;
+        set(Message::MKDIR).emulated       = &L::emu_mkdir;
+        set(Message::LINK).emulated        = &L::emu_link;
+        set(Message::SYMLINK).emulated     = &L::emu_symlink;
+        set(Message::MKNOD).emulated       = &L::emu_mknod;
+        set(Message::GETATTR).emulated     = &L::emu_getattr;
+        set(Message::READDIR).emulated     = &L::emu_readdir;
+        set(Message::READDIRPLUS).emulated = &L::emu_readdirplus;
+        set(Message::UNLINK).emulated      = &L::emu_unlink;
+        set(Message::RMDIR).emulated       = &L::emu_rmdir;
+        set(Message::RENAME).emulated      = &L::emu_rename;
+
+        set(Message::GETATTR).mapped       = &L::map_getattr;
+        set(Message::READDIRPLUS).mapped   = &L::map_readdirplus;
+        return t;
+    }();
+    static const TypeInfo unknown = { 0, true, nullptr, nullptr };
+
+    if (ty < Message::FIRST_TYPE || ty > Message::LAST_TYPE)
+        return unknown;
+    return table[ty - Message::FIRST_TYPE];
 }
 
 int erlent::LocalRequestProcessor::process(Request &req) {
     static std::mutex m;
 
-    bool nL = needsLock(req);
-    if (nL)
+    if (req.getMessageType() == Message::COMPOUND)
+        return static_cast<CompoundRequest &>(req).processEach(*this);
+
+    const TypeInfo &ti = typeInfo(req.getMessageType());
+    if (ti.lock)
         m.lock();
-    int res = do_process(req);
-    if (nL)
+    int res = do_process(req, ti);
+    if (ti.lock)
         m.unlock();
     return res;
 }
 
-int erlent::LocalRequestProcessor::do_process(Request &req) {
+// the pathname of entry 'name' of directory 'dir'
+string erlent::LocalRequestProcessor::entryPath(const string &dir, const string &name)
+{
+    if (name == ".")
+        return dir;
+    if (name == "..")
+        return dirof(dir);
+    return pathConcat(dir, name);
+}
+
+// replace the attributes of 'pathname' by the emulated ones
+void erlent::LocalRequestProcessor::emu_attrs(const string &pathname, struct stat *buf)
+{
+    Attrs a;
+    DIRFILE dt = S_ISDIR(buf->st_mode) ? DIRECTORY : FILE;
+    if (readAttrs(pathname, dt, &a) == 0) {
+        buf->st_uid = uid2outer(a.uid);
+        buf->st_gid = gid2outer(a.gid);
+        buf->st_mode = (buf->st_mode & ~ATTR_MASK) | (a.mode & ATTR_MASK);
+    } else {
+//        cerr << "ERROR: readAttrs failed for " << pathname << " (assuming" << (dt == DIR ? "DIR" : "FILE")
+//             << " from mode 0" << oct << buf->st_mode << endl;
+        // something went really wrong in readAttrs (because readAttrs returns default
+        // values on ENOENT), set uid/gid to (outer) root (which will be mapped to
+        // nobody/nogroup in the container)
+        buf->st_uid = 0;
+        buf->st_gid = 0;
+        buf->st_mode = buf->st_mode & ~(S_IRWXG | S_IRWXO);
+    }
+    if (dt == DIRECTORY) {
+        // Correct the st_size field for directories.
+        // (st_size is the number of files/dirs in
+        // the directory; we must not count the
+        // emulation files)
+        struct dirent *ent;
+        DIR *dir = opendir(pathname.c_str());
+        if (dir != NULL) {
+            buf->st_size = 0;
+            while ((ent = readdir(dir)) != NULL) {
+                if (!isEmuFile(ent->d_name))
+                    ++buf->st_size;
+            }
+            closedir(dir);
+        }
+    }
+}
+
+// files of the user running erlent belong to the initial user inside
+void erlent::LocalRequestProcessor::map_attrs(struct stat *buf)
+{
+    if (buf->st_uid == getuid() || buf->st_uid == geteuid())
+        buf->st_uid = uid2outer(params->initialUID);
+    int n = getgroups(0, NULL);
+    gid_t *groups = new gid_t[n+2];
+    groups[0] = getgid();
+    groups[1] = getegid();
+    int nn = getgroups(n, &groups[2]);
+    if (nn >= 0) {
+        if (nn > n)
+            nn = n;
+        nn += 2;
+        for (int i=0; i<nn; ++i) {
+            if (groups[i] == buf->st_gid) {
+                buf->st_gid = gid2outer(params->initialGID);
+                break;
+            }
+        }
+    }
+    delete[] groups;
+}
+
+void erlent::LocalRequestProcessor::mapToInner(UidGid &ug) const
+{
+    ug.setUid(uid2inner(ug.getUid()));
+    ug.setGid(gid2inner(ug.getGid()));
+}
+
+void erlent::LocalRequestProcessor::emu_open(Request &req)
+{
+    OpenRequest &openreq = static_cast<OpenRequest &>(req);
+    openreq.setFlags(openreq.getFlags() & ALLOWED_OPEN_FLAGS_MASK);
+    openreq.performLocally();
+}
+
+void erlent::LocalRequestProcessor::emu_chown(Request &req)
+{
+    ChownRequest &chownreq = static_cast<ChownRequest &>(req);
+    mapToInner(chownreq);
+    emu_chown(req.getReply(), chownreq.getPathname(), chownreq.getUid(), chownreq.getGid());
+}
+
+void erlent::LocalRequestProcessor::emu_chmod(Request &req)
+{
+    ChmodRequest &chmodreq = static_cast<ChmodRequest &>(req);
+    emu_chmod(req.getReply(), chmodreq.getPathname(), chmodreq.getMode());
+}
+
+void erlent::LocalRequestProcessor::emu_creat(Request &req)
+{
+    CreatRequest &creatreq = static_cast<CreatRequest &>(req);
+    Reply &repl = req.getReply();
+    mapToInner(creatreq);
+    mode_t origMode = creatreq.getMode();
+    creatreq.setMode(filemode);
+    creatreq.performLocally();
+    if (repl.getResult() == 0)
+        emu_creat_mkdir(repl, creatreq.getPathname(), FILE, origMode, creatreq.getUid(), creatreq.getGid());
+}
+
+void erlent::LocalRequestProcessor::emu_mkdir(Request &req)
+{
+    MkdirRequest &mkdirreq = static_cast<MkdirRequest &>(req);
+    Reply &repl = req.getReply();
+    mapToInner(mkdirreq);
+    mode_t origMode = mkdirreq.getMode();
+    mkdirreq.setMode(dirmode);
+    mkdirreq.performLocally();
+    if (repl.getResult() == 0)
+        emu_creat_mkdir(repl, mkdirreq.getPathname(), DIRECTORY, origMode, mkdirreq.getUid(), mkdirreq.getGid());
+}
+
+void erlent::LocalRequestProcessor::emu_link(Request &req)
+{
+    LinkRequest &linkreq = static_cast<LinkRequest &>(req);
+    Reply &repl = req.getReply();
+    linkreq.performLocally();
+    if (repl.getResult() == 0) {
+        int res = link(attrsFileName(linkreq.getPathname(), FILE).c_str(),
+                       attrsFileName(linkreq.getPathname2(), FILE).c_str());
+        if (res == -1)
+            repl.setResult(-EIO);
+    }
+}
+
+void erlent::LocalRequestProcessor::emu_symlink(Request &req)
+{
+    SymlinkRequest &symlinkreq = static_cast<SymlinkRequest &>(req);
+    Reply &repl = req.getReply();
+    mapToInner(symlinkreq);
+    symlinkreq.performLocally();
+    if (repl.getResult() == 0) {
+        emu_creat_mkdir(repl, symlinkreq.getPathname(), FILE,
+                        S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO, symlinkreq.getUid(), symlinkreq.getGid());
+    }
+}
+
+void erlent::LocalRequestProcessor::emu_mknod(Request &req)
+{
+    MknodRequest &mknodreq = static_cast<MknodRequest &>(req);
+    Reply &repl = req.getReply();
+    mapToInner(mknodreq);
+    mode_t mode = mknodreq.getMode();
+    mknodreq.setMode((mode & ~ATTR_MASK) | filemode);
+    mknodreq.performLocally();
+    if (repl.getResult() == 0)
+        emu_creat_mkdir(repl, mknodreq.getPathname(), FILE,
+                        mode, mknodreq.getUid(), mknodreq.getGid());
+}
+
+void erlent::LocalRequestProcessor::emu_getattr(Request &req)
+{
+    GetattrRequest &getattrreq = static_cast<GetattrRequest &>(req);
+    GetattrReply &garepl = getattrreq.getReply();
+    getattrreq.performLocally();
+    if (garepl.getResult() == 0)
+        emu_attrs(getattrreq.getPathname(), garepl.getStbuf());
+}
+
+void erlent::LocalRequestProcessor::emu_readdir(Request &req)
+{
+    ReaddirRequest &readdirreq = static_cast<ReaddirRequest &>(req);
+    readdirreq.performLocally();
+    ReaddirReply &rdr = readdirreq.getReply();
+    rdr.filter([](const string &name) { return !isEmuFile(name); });
+}
+
+void erlent::LocalRequestProcessor::emu_readdirplus(Request &req)
+{
+    ReaddirplusRequest &readdirplusreq = static_cast<ReaddirplusRequest &>(req);
+    readdirplusreq.performLocally();
+    ReaddirplusReply &rdr = readdirplusreq.getReply();
+    rdr.filter([](const string &name) { return !isEmuFile(name); });
+    for (auto it = rdr.entries_begin(); it != rdr.entries_end(); ++it) {
+        if (it->stbuf.st_mode != 0)
+            emu_attrs(entryPath(readdirplusreq.getPathname(), it->name), &it->stbuf);
+    }
+}
+
+void erlent::LocalRequestProcessor::emu_unlink(Request &req)
+{
+    UnlinkRequest &unlinkreq = static_cast<UnlinkRequest &>(req);
+    unlinkreq.performLocally();
+    if (req.getReply().getResult() == 0)
+        unlink(attrsFileName(unlinkreq.getPathname(), FILE).c_str());
+}
+
+void erlent::LocalRequestProcessor::emu_rmdir(Request &req)
+{
+    RmdirRequest &rmdirreq = static_cast<RmdirRequest &>(req);
+    // the directory can only be removed when it is empty, so delete
+    // the attributes file first but save its contents in case
+    // the rmdir fails.
+    Attrs a;
+    readAttrs(rmdirreq.getPathname(), DIRECTORY, &a);
+    unlink(attrsFileName(rmdirreq.getPathname(), DIRECTORY).c_str());
+    rmdirreq.performLocally();
+    if (req.getReply().getResult() != 0)
+        writeAttrs(rmdirreq.getPathname(), DIRECTORY, &a);
+}
+
+void erlent::LocalRequestProcessor::emu_rename(Request &req)
+{
+    RenameRequest &renamereq = static_cast<RenameRequest &>(req);
+    renamereq.performLocally();
+    if (req.getReply().getResult() == 0) {
+        if (dirfile(renamereq.getPathname2()) == FILE) {
+            rename(attrsFileName(renamereq.getPathname(), FILE).c_str(),
+                   attrsFileName(renamereq.getPathname2(), FILE).c_str());
+        }
+    }
+}
+
+void erlent::LocalRequestProcessor::map_getattr(Request &req)
+{
+    GetattrRequest &getattrreq = static_cast<GetattrRequest &>(req);
+    GetattrReply &garepl = getattrreq.getReply();
+    getattrreq.performLocally();
+    if (garepl.getResult() == 0)
+        map_attrs(garepl.getStbuf());
+}
+
+void erlent::LocalRequestProcessor::map_readdirplus(Request &req)
+{
+    ReaddirplusRequest &readdirplusreq = static_cast<ReaddirplusRequest &>(req);
+    readdirplusreq.performLocally();
+    ReaddirplusReply &rdr = readdirplusreq.getReply();
+    for (auto it = rdr.entries_begin(); it != rdr.entries_end(); ++it) {
+        if (it->stbuf.st_mode != 0)
+            map_attrs(&it->stbuf);
+    }
+}
+
+int erlent::LocalRequestProcessor::do_process(Request &req, const TypeInfo &ti) {
     AttrType attrType = getAttrType(req);
 
-    translatePath(req);
+    translatePath(req, ti);
     Reply &repl = req.getReply();
-    RequestWithPathname *rwp = dynamic_cast<RequestWithPathname *>(&req);
-    const string *pathname = rwp != nullptr ? &rwp->getPathname() : nullptr;
-    RequestWithTwoPathnames *rw2p = dynamic_cast<RequestWithTwoPathnames *>(&req);
-    const string *pathname2 = rw2p != nullptr ? &rw2p->getPathname2() : nullptr;
+    Handler handler = nullptr;
 
     switch(attrType) {
     case AttrType::Emulated: {
-        if (pathname != nullptr) {
-            if (isEmuFile(*pathname))
+        if (ti.pathnames > 0) {
+            const string &pathname = static_cast<RequestWithPathname &>(req).getPathname();
+            if (isEmuFile(pathname))
                 return -EPERM;
-            if (pathname2 != nullptr && isEmuFile(*pathname2))
+            if (ti.pathnames == 2 && isEmuFile(static_cast<RequestWithTwoPathnames &>(req).getPathname2()))
                 return -EPERM;
-            dbg() << "performing request on '" << *pathname << "'" << endl;
+            dbg() << "performing request on '" << pathname << "'" << endl;
         }
-
-        OpenRequest *openreq = dynamic_cast<OpenRequest *>(&req);
-        if (openreq != nullptr) {
-            openreq->setFlags(openreq->getFlags() & ALLOWED_OPEN_FLAGS_MASK);
-        }
-
-        UidGid *ug = dynamic_cast<UidGid *>(&req);
-        if (ug != nullptr) {
-            ug->setUid(uid2inner(ug->getUid()));
-            ug->setGid(gid2inner(ug->getGid()));
-        }
-        ChownRequest *chownreq = dynamic_cast<ChownRequest *>(&req);
-        ChmodRequest *chmodreq = dynamic_cast<ChmodRequest *>(&req);
-        GetattrRequest *getattrreq = dynamic_cast<GetattrRequest *>(&req);
-        CreatRequest *creatreq = dynamic_cast<CreatRequest *>(&req);
-        MkdirRequest *mkdirreq = dynamic_cast<MkdirRequest *>(&req);
-        ReaddirRequest *readdirreq = dynamic_cast<ReaddirRequest *>(&req);
-        UnlinkRequest *unlinkreq = dynamic_cast<UnlinkRequest *>(&req);
-        RmdirRequest *rmdirreq = dynamic_cast<RmdirRequest *>(&req);
-        RenameRequest *renamereq = dynamic_cast<RenameRequest *>(&req);
-        LinkRequest *linkreq = dynamic_cast<LinkRequest *>(&req);
-        SymlinkRequest *symlinkreq = dynamic_cast<SymlinkRequest *>(&req);
-        MknodRequest *mknodreq = dynamic_cast<MknodRequest *>(&req);
-        if (chownreq != nullptr) {
-            emu_chown(repl, *pathname, chownreq->getUid(), chownreq->getGid());
-        } else if (chmodreq != nullptr) {
-            emu_chmod(repl, *pathname, chmodreq->getMode());
-        } else if (creatreq != nullptr) {
-            mode_t origMode = creatreq->getMode();
-            creatreq->setMode(filemode);
-            creatreq->performLocally();
-            if (repl.getResult() == 0)
-                emu_creat_mkdir(repl, *pathname, FILE, origMode, creatreq->getUid(), creatreq->getGid());
-        } else if (mkdirreq != nullptr) {
-            mode_t origMode = mkdirreq->getMode();
-            mkdirreq->setMode(dirmode);
-            mkdirreq->performLocally();
-            if (repl.getResult() == 0)
-                emu_creat_mkdir(repl, *pathname, DIRECTORY, origMode, mkdirreq->getUid(), mkdirreq->getGid());
-        } else if (linkreq != nullptr) {
-            linkreq->performLocally();
-            if (repl.getResult() == 0) {
-                int res = link(attrsFileName(linkreq->getPathname(), FILE).c_str(),
-                               attrsFileName(linkreq->getPathname2(), FILE).c_str());
-                if (res == -1)
-                    repl.setResult(-EIO);
-            }
-        } else if (symlinkreq != nullptr) {
-            symlinkreq->performLocally();
-            if (repl.getResult() == 0) {
-                emu_creat_mkdir(repl, symlinkreq->getPathname(), FILE,
-                                S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO, symlinkreq->getUid(), symlinkreq->getGid());
-            }
-        } else if (mknodreq != nullptr) {
-            mode_t mode = mknodreq->getMode();
-            mknodreq->setMode((mode & ~ATTR_MASK) | filemode);
-            mknodreq->performLocally();
-            if (repl.getResult() == 0)
-                emu_creat_mkdir(repl, mknodreq->getPathname(), FILE,
-                                mode, mknodreq->getUid(), mknodreq->getGid());
-        } else if (getattrreq != nullptr) {
-            GetattrReply &garepl = getattrreq->getReply();
-            getattrreq->performLocally();
-            if (garepl.getResult() == 0) {
-                Attrs a;
-                struct stat *buf = garepl.getStbuf();
-                DIRFILE dt = S_ISDIR(buf->st_mode) ? DIRECTORY : FILE;
-                if (readAttrs(*pathname, dt, &a) == 0) {
-                    buf->st_uid = uid2outer(a.uid);
-                    buf->st_gid = gid2outer(a.gid);
-                    buf->st_mode = (buf->st_mode & ~ATTR_MASK) | (a.mode & ATTR_MASK);
-                } else {
-//                    cerr << "ERROR: readAttrs failed for " << *pathname << " (assuming" << (dt == DIR ? "DIR" : "FILE")
-//                         << " from mode 0" << oct << buf->st_mode << endl;
-                    // something went really wrong in readAttrs (because readAttrs returns default
-                    // values on ENOENT), set uid/gid to (outer) root (which will be mapped to
-                    // nobody/nogroup in the container)
-                    buf->st_uid = 0;
-                    buf->st_gid = 0;
-                    buf->st_mode = buf->st_mode & ~(S_IRWXG | S_IRWXO);
-                }
-                if (dt == DIRECTORY) {
-                    // Correct the st_size field for directories.
-                    // (st_size is the number of files/dirs in
-                    // the directory; we must not count the
-                    // emulation files)
-                    struct dirent *ent;
-                    DIR *dir = opendir(pathname->c_str());
-                    if (dir != NULL) {
-                        buf->st_size = 0;
-                        while ((ent = readdir(dir)) != NULL) {
-                            if (!isEmuFile(ent->d_name))
-                                ++buf->st_size;
-                        }
-                        closedir(dir);
-                    }
-                }
-            }
-        } else if (readdirreq != nullptr) {
-            readdirreq->performLocally();
-            ReaddirReply &rdr = readdirreq->getReply();
-            rdr.filter([](const string &name) { return !isEmuFile(name); });
-        } else if (unlinkreq != nullptr) {
-            unlinkreq->performLocally();
-            if (repl.getResult() == 0)
-                unlink(attrsFileName(unlinkreq->getPathname(), FILE).c_str());
-        } else if (rmdirreq != nullptr) {
-            // the directory can only be removed when it is empty, so delete
-            // the attributes file first but save its contents in case
-            // the rmdir fails.
-            Attrs a;
-            readAttrs(rmdirreq->getPathname(), DIRECTORY, &a);
-            unlink(attrsFileName(rmdirreq->getPathname(), DIRECTORY).c_str());
-            rmdirreq->performLocally();
-            if (repl.getResult() != 0)
-                writeAttrs(rmdirreq->getPathname(), DIRECTORY, &a);
-        } else if (renamereq != nullptr) {
-            renamereq->performLocally();
-            if (repl.getResult() == 0) {
-                if (dirfile(renamereq->getPathname2()) == FILE) {
-                    rename(attrsFileName(renamereq->getPathname(), FILE).c_str(),
-                           attrsFileName(renamereq->getPathname2(), FILE).c_str());
-                }
-            }
-        } else
-            req.performLocally();
+        handler = ti.emulated;
         break;
     }
-    case AttrType::Mapped: {
-        GetattrRequest *getattrreq = dynamic_cast<GetattrRequest *>(&req);
-        if (getattrreq != nullptr) {
-            GetattrReply &garepl = getattrreq->getReply();
-            getattrreq->performLocally();
-            if (garepl.getResult() == 0) {
-                struct stat *buf = garepl.getStbuf();
-                if (buf->st_uid == getuid() || buf->st_uid == geteuid())
-                    buf->st_uid = uid2outer(params->initialUID);
-                int n = getgroups(0, NULL);
-                gid_t *groups = new gid_t[n+2];
-                groups[0] = getgid();
-                groups[1] = getegid();
-                int nn = getgroups(n, &groups[2]);
-                if (nn >= 0) {
-                    if (nn > n)
-                        nn = n;
-                    nn += 2;
-                    for (int i=0; i<nn; ++i) {
-                        if (groups[i] == buf->st_gid) {
-                            buf->st_gid = gid2outer(params->initialGID);
-                            break;
-                        }
-                    }
-                }
-                delete[] groups;
-            }
-        } else
-            req.performLocally();
+    case AttrType::Mapped:
+        handler = ti.mapped;
         break;
-    }
     case AttrType::Untranslated:
-        req.performLocally();
         break;
     }
+    if (handler != nullptr)
+        (this->*handler)(req);
+    else
+        req.performLocally();
     dbg() << "(local) result is " << repl.getResultMessage() << endl;
     return repl.getResult();
 }
@@ -0,0 +1,647 @@
+#include "erlent/erlent.hh"
+#include "erlent/metacache.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+extern "C" {
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+// (bound to the const reference parameter of chrono::seconds)
+const int MetadataCache::MAX_AGE;
+
+namespace {
+    // entries are stored under their kind followed by the path
+    enum Kind { ATTR = 'a', LINK = 'l', LISTING = 'd', TREE = 't' };
+
+    struct Entry {
+        int res;
+        struct stat stbuf;          // ATTR
+        string target;              // LINK
+        vector<string> names;       // LISTING
+        vector<uint64_t> cookies;   // LISTING (of each name)
+        chrono::steady_clock::time_point expires;
+        vector<string> dirs;        // the watched directories it depends on
+        list<string>::iterator lru;
+        vector<LeaseHolder *> holders;  // ATTR entries leased to clients
+    };
+
+    // a tree leased with leaseTree()
+    struct TreeLease {
+        string root;
+        unordered_set<string> dirs;
+        LeaseHolder *holder;
+        chrono::steady_clock::time_point expires;
+    };
+
+    struct Watch {
+        int wd;                     // -1 if the watch is gone
+        unsigned refs;              // entries and misses depending on it
+        uint64_t changes;           // number of events so far
+    };
+}
+
+// Leases end this long before the entry expires, to allow for the
+// time the reply takes to reach the client.
+static const int LEASE_MARGIN = 1;
+
+static const uint32_t WATCH_MASK = IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+static mutex cacheMutex;
+static size_t maxEntries = 0;       // 0: disabled
+static int inotifyFd = -1;
+static unordered_map<string, Entry> entries;
+static list<string> lru;            // keys of 'entries', most recently used first
+static unordered_map<string, Watch> watches;
+// the names under which each watched directory is known (there can be
+// several, e.g. through symbolic links)
+static unordered_map<int, set<string>> watchedDirs;
+static list<TreeLease> treeLeases;
+
+
+// Only absolute paths without empty, '.' or '..' components are cached.
+static bool isCanonical(const string &path)
+{
+    if (path.empty() || path[0] != '/')
+        return false;
+    if (path.size() == 1)
+        return true;
+    size_t start = 1;
+    for (;;) {
+        size_t end = path.find('/', start);
+        size_t len = (end == string::npos ? path.size() : end) - start;
+        if (len == 0 || path.compare(start, len, ".") == 0 || path.compare(start, len, "..") == 0)
+            return false;
+        if (end == string::npos)
+            return true;
+        start = end + 1;
+    }
+}
+
+static string parentOf(const string &path)
+{
+    size_t pos = path.rfind('/');
+    return pos == 0 || pos == string::npos ? "/" : path.substr(0, pos);
+}
+
+static string childOf(const string &dir, const string &name)
+{
+    return dir == "/" ? dir + name : dir + "/" + name;
+}
+
+static string keyOf(Kind kind, const string &path)
+{
+    return string(1, (char)kind) + path;
+}
+
+
+static bool addWatch(const string &dir)
+{
+    auto it = watches.find(dir);
+    if (it != watches.end() && it->second.wd != -1) {
+        ++it->second.refs;
+        return true;
+    }
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(), WATCH_MASK);
+    if (wd == -1) {
+        int err = errno;
+        dbg() << "Cannot watch '" << dir << "': " << strerror(err) << endl;
+        return false;
+    }
+    if (it == watches.end()) {
+        Watch &w = watches[dir];
+        w.refs = 0;
+        w.changes = 0;
+        it = watches.find(dir);
+    }
+    it->second.wd = wd;
+    ++it->second.refs;
+    watchedDirs[wd].insert(dir);
+    return true;
+}
+
+// 'dir' is no longer watched under watch descriptor 'wd'
+static void unmapWatch(const string &dir, int wd)
+{
+    auto d = watchedDirs.find(wd);
+    if (d == watchedDirs.end())
+        return;
+    d->second.erase(dir);
+    if (d->second.empty()) {
+        watchedDirs.erase(d);
+        inotify_rm_watch(inotifyFd, wd);
+    }
+}
+
+static void releaseWatch(const string &dir)
+{
+    auto it = watches.find(dir);
+    if (it == watches.end() || --it->second.refs > 0)
+        return;
+    if (it->second.wd != -1)
+        unmapWatch(dir, it->second.wd);
+    watches.erase(it);
+}
+
+static uint64_t changesOf(const vector<string> &dirs)
+{
+    uint64_t changes = 0;
+    for (const string &dir : dirs)
+        changes += watches[dir].changes;
+    return changes;
+}
+
+static void releaseMiss(MetadataCache::Miss &miss)
+{
+    for (const string &dir : miss.dirs)
+        releaseWatch(dir);
+    miss.dirs.clear();
+    miss.key.clear();
+}
+
+MetadataCache::Miss::~Miss()
+{
+    if (key.empty())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    releaseMiss(*this);
+}
+
+
+static unordered_map<string, Entry>::iterator eraseEntry(unordered_map<string, Entry>::iterator it)
+{
+    for (LeaseHolder *holder : it->second.holders)
+        holder->revoke(it->first.substr(1));
+    for (const string &dir : it->second.dirs)
+        releaseWatch(dir);
+    lru.erase(it->second.lru);
+    return entries.erase(it);
+}
+
+static void invalidate(Kind kind, const string &path)
+{
+    auto it = entries.find(keyOf(kind, path));
+    if (it != entries.end())
+        eraseEntry(it);
+}
+
+// invalidate the entries of 'dir' and everything below
+static void invalidateTree(const string &dir)
+{
+    string prefix = dir == "/" ? dir : dir + "/";
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        const string &key = it->first;
+        if (key.compare(1, string::npos, dir) == 0 || key.compare(1, prefix.size(), prefix) == 0)
+            it = eraseEntry(it);
+        else
+            ++it;
+    }
+}
+
+// A new name for an existing file (link()) changes st_nlink and
+// st_ctime of its other names, which is not reported for them.
+static void checkNewLink(const string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1 || st.st_nlink < 2)
+        return;
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        const Entry &e = it->second;
+        if (it->first[0] == ATTR && e.res == 0 && e.stbuf.st_ino == st.st_ino && e.stbuf.st_dev == st.st_dev)
+            it = eraseEntry(it);
+        else
+            ++it;
+    }
+}
+
+static list<TreeLease>::iterator eraseTreeLease(list<TreeLease>::iterator it, bool revoke)
+{
+    if (revoke)
+        it->holder->revoke(it->root);
+    for (const string &dir : it->dirs)
+        releaseWatch(dir);
+    return treeLeases.erase(it);
+}
+
+// Revoke the trees containing 'dir' (all of them if 'dir' is empty);
+// those that have expired are only forgotten.
+static void revokeTrees(const string &dir)
+{
+    auto now = chrono::steady_clock::now();
+    for (auto it = treeLeases.begin(); it != treeLeases.end(); ) {
+        bool expired = now >= it->expires;
+        if (expired || dir.empty() || it->dirs.count(dir) > 0)
+            it = eraseTreeLease(it, !expired);
+        else
+            ++it;
+    }
+}
+
+static void handleEvent(const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        dbg() << "inotify queue overflow, clearing the metadata cache." << endl;
+        for (auto &w : watches)
+            ++w.second.changes;
+        for (auto it = entries.begin(); it != entries.end(); )
+            it = eraseEntry(it);
+        revokeTrees("");
+        return;
+    }
+    auto d = watchedDirs.find(ev->wd);
+    if (d == watchedDirs.end())
+        return;
+    // (a copy, invalidating entries can remove the watch)
+    set<string> dirs = d->second;
+    for (const string &dir : dirs) {
+        auto w = watches.find(dir);
+        if (w != watches.end())
+            ++w->second.changes;
+        if (!treeLeases.empty())
+            revokeTrees(dir);
+
+        if (ev->len > 0) {
+            string path = childOf(dir, ev->name);
+            invalidate(ATTR, path);
+            invalidate(LINK, path);
+            if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                // st_mtime and st_nlink of the directory change, too
+                invalidate(LISTING, dir);
+                invalidate(ATTR, dir);
+                if (ev->mask & IN_ISDIR)
+                    invalidateTree(path);
+                else if (ev->mask & IN_CREATE)
+                    checkNewLink(path);
+            }
+        } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            invalidateTree(dir);
+            // the watch does not refer to 'dir' anymore
+            unmapWatch(dir, ev->wd);
+            w = watches.find(dir);
+            if (w != watches.end() && w->second.wd == ev->wd)
+                w->second.wd = -1;
+        } else
+            invalidate(ATTR, dir);
+    }
+}
+
+// Handle all pending inotify events.
+static void drain()
+{
+    alignas(struct inotify_event) char buf[16 * 1024];
+    ssize_t n;
+    while ((n = read(inotifyFd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handleEvent(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+
+static Entry *findEntry(Kind kind, const string &path)
+{
+    auto it = entries.find(keyOf(kind, path));
+    if (it == entries.end())
+        return nullptr;
+    if (chrono::steady_clock::now() >= it->second.expires) {
+        // (the leases have ended already)
+        it->second.holders.clear();
+        eraseEntry(it);
+        return nullptr;
+    }
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return &it->second;
+}
+
+// Watch 'dir' for storing the result of 'kind' for 'path' later.
+static void prepare(MetadataCache::Miss &miss, Kind kind, const string &path, const string &dir)
+{
+    if (!isCanonical(path) || !addWatch(dir))
+        return;
+    miss.key = keyOf(kind, path);
+    miss.dirs.push_back(dir);
+    miss.changes = changesOf(miss.dirs);
+}
+
+// Whether the result of the lookup that has missed can be stored.
+static bool storable(MetadataCache::Miss &miss, int res)
+{
+    drain();
+    if ((res == 0 || res == -ENOENT) && changesOf(miss.dirs) == miss.changes)
+        return true;
+    releaseMiss(miss);
+    return false;
+}
+
+// Create (or replace) the entry for 'key', which takes over the
+// references to the watches of 'dirs'.
+static Entry &insert(const string &key, int res, vector<string> &dirs)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+        eraseEntry(it);
+    else if (entries.size() >= maxEntries)
+        eraseEntry(entries.find(lru.back()));
+    lru.push_front(key);
+    Entry &e = entries[key];
+    e.res = res;
+    e.expires = chrono::steady_clock::now() + chrono::seconds(MetadataCache::MAX_AGE);
+    e.dirs.swap(dirs);
+    e.lru = lru.begin();
+    return e;
+}
+
+// The attributes of a directory also change with its entries (st_mtime,
+// st_nlink), so it is watched itself as well. It is stat'ed again once
+// the watch is there, as changes in between would be missed.
+// Files with several hard links are not cached, changes through their
+// other names are not reported for this one.
+static void insertAttr(const string &path, int res, const struct stat &stbuf, vector<string> &dirs)
+{
+    struct stat current = stbuf;
+    if (res == 0 && !S_ISDIR(stbuf.st_mode) && stbuf.st_nlink > 1) {
+        for (const string &dir : dirs)
+            releaseWatch(dir);
+        return;
+    }
+    if (res == 0 && S_ISDIR(stbuf.st_mode) && find(dirs.begin(), dirs.end(), path) == dirs.end()) {
+        if (!addWatch(path)) {
+            for (const string &dir : dirs)
+                releaseWatch(dir);
+            return;
+        }
+        dirs.push_back(path);
+        if (lstat(path.c_str(), &current) == -1 || !S_ISDIR(current.st_mode)) {
+            for (const string &dir : dirs)
+                releaseWatch(dir);
+            return;
+        }
+    }
+    insert(keyOf(ATTR, path), res, dirs).stbuf = current;
+}
+
+
+void MetadataCache::enable(size_t max)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    if (inotifyFd == -1) {
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd == -1) {
+            int err = errno;
+            cerr << "Could not initialize inotify, not caching metadata: " << strerror(err) << endl;
+            return;
+        }
+    }
+    maxEntries = max;
+}
+
+bool MetadataCache::isEnabled()
+{
+    return maxEntries != 0;
+}
+
+bool MetadataCache::lookupAttr(const string &path, int &res, struct stat &stbuf, Miss &miss)
+{
+    if (!isEnabled())
+        return false;
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+    if (Entry *e = findEntry(ATTR, path)) {
+        res = e->res;
+        stbuf = e->stbuf;
+        return true;
+    }
+    prepare(miss, ATTR, path, parentOf(path));
+    return false;
+}
+
+void MetadataCache::storeAttr(Miss &miss, int res, const struct stat &stbuf)
+{
+    if (miss.key.empty())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    if (storable(miss, res)) {
+        insertAttr(miss.key.substr(1), res, stbuf, miss.dirs);
+        miss.key.clear();
+    }
+}
+
+bool MetadataCache::lookupLink(const string &path, int &res, string &target, Miss &miss)
+{
+    if (!isEnabled())
+        return false;
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+    if (Entry *e = findEntry(LINK, path)) {
+        res = e->res;
+        target = e->target;
+        return true;
+    }
+    prepare(miss, LINK, path, parentOf(path));
+    return false;
+}
+
+void MetadataCache::storeLink(Miss &miss, int res, const string &target)
+{
+    if (miss.key.empty())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    // (-EINVAL: not a symbolic link, which changes with the directory
+    // entry only, like -ENOENT)
+    if (storable(miss, res == -EINVAL ? 0 : res)) {
+        insert(miss.key, res, miss.dirs).target = target;
+        miss.key.clear();
+    }
+}
+
+bool MetadataCache::lookupDir(const string &path, int &res, vector<string> &names,
+                              vector<uint64_t> &cookies, Miss &miss)
+{
+    if (!isEnabled())
+        return false;
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+    if (Entry *e = findEntry(LISTING, path)) {
+        res = e->res;
+        names = e->names;
+        cookies = e->cookies;
+        return true;
+    }
+    prepare(miss, LISTING, path, path);
+    return false;
+}
+
+void MetadataCache::storeDir(Miss &miss, int res, const vector<string> &names,
+                             const vector<uint64_t> &cookies)
+{
+    if (miss.key.empty())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    if (storable(miss, res)) {
+        Entry &e = insert(miss.key, res, miss.dirs);
+        e.names = names;
+        e.cookies = cookies;
+        miss.key.clear();
+    }
+}
+
+bool MetadataCache::lookupDirAttrs(const string &path, int &res, vector<string> &names,
+                                   vector<uint64_t> &cookies, vector<struct stat> &stbufs,
+                                   Miss &miss)
+{
+    if (!isEnabled())
+        return false;
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+    if (Entry *e = findEntry(LISTING, path)) {
+        res = e->res;
+        names = e->names;
+        cookies = e->cookies;
+        stbufs.resize(names.size());
+        for (size_t i=0; i<names.size(); ++i) {
+            const string &name = names[i];
+            Entry *a = findEntry(ATTR, name == "." ? path : name == ".." ? parentOf(path) : childOf(path, name));
+            if (a != nullptr && a->res == 0)
+                stbufs[i] = a->stbuf;
+            else
+                memset(&stbufs[i], 0, sizeof(stbufs[i]));
+        }
+        return true;
+    }
+    prepare(miss, LISTING, path, path);
+    return false;
+}
+
+// The attributes of the entries only depend on the directory (which
+// the miss is watching already), unless they are directories
+// themselves ("." and ".." are left to GETATTR).
+void MetadataCache::storeDirAttrs(Miss &miss, int res, const vector<string> &names,
+                                  const vector<uint64_t> &cookies,
+                                  const vector<struct stat> &stbufs)
+{
+    if (miss.key.empty())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    if (res != 0 || !storable(miss, res)) {
+        releaseMiss(miss);
+        return;
+    }
+    const string dir = miss.key.substr(1);
+    for (size_t i=0; i<names.size(); ++i) {
+        if (stbufs[i].st_mode == 0 || names[i] == "." || names[i] == "..")
+            continue;
+        if (!addWatch(dir))
+            continue;
+        vector<string> dirs(1, dir);
+        insertAttr(childOf(dir, names[i]), 0, stbufs[i], dirs);
+    }
+    Entry &e = insert(miss.key, res, miss.dirs);
+    e.names = names;
+    e.cookies = cookies;
+    miss.key.clear();
+}
+
+static bool sameAttrs(const struct stat &a, const struct stat &b)
+{
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_mode == b.st_mode &&
+        a.st_nlink == b.st_nlink && a.st_uid == b.st_uid && a.st_gid == b.st_gid &&
+        a.st_rdev == b.st_rdev && a.st_size == b.st_size &&
+        a.st_mtime == b.st_mtime && a.st_ctime == b.st_ctime;
+}
+
+unsigned MetadataCache::leaseAttr(const string &path, int res, const struct stat &stbuf, LeaseHolder *holder)
+{
+    if (!isEnabled())
+        return 0;
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+    auto it = entries.find(keyOf(ATTR, path));
+    if (it == entries.end())
+        return 0;
+    Entry &e = it->second;
+    if (e.res != res || (res == 0 && !sameAttrs(e.stbuf, stbuf)))
+        return 0;
+    auto left = chrono::duration_cast<chrono::seconds>(e.expires - chrono::steady_clock::now());
+    if (left.count() <= LEASE_MARGIN)
+        return 0;
+    if (find(e.holders.begin(), e.holders.end(), holder) == e.holders.end())
+        e.holders.push_back(holder);
+    return left.count() - LEASE_MARGIN;
+}
+
+void MetadataCache::releaseLeases(LeaseHolder *holder)
+{
+    if (!isEnabled())
+        return;
+    lock_guard<mutex> lock(cacheMutex);
+    for (auto &ke : entries) {
+        vector<LeaseHolder *> &holders = ke.second.holders;
+        holders.erase(remove(holders.begin(), holders.end(), holder), holders.end());
+    }
+    for (auto it = treeLeases.begin(); it != treeLeases.end(); ) {
+        if (it->holder == holder)
+            it = eraseTreeLease(it, false);
+        else
+            ++it;
+    }
+}
+
+bool MetadataCache::watchTree(const string &root, const string &dir, Miss &miss)
+{
+    if (!isEnabled())
+        return false;
+    lock_guard<mutex> lock(cacheMutex);
+    if (!isCanonical(dir) || !addWatch(dir))
+        return false;
+    if (miss.key.empty())
+        miss.key = keyOf(TREE, root);
+    miss.dirs.push_back(dir);
+    miss.changes += watches[dir].changes;
+    return true;
+}
+
+unsigned MetadataCache::leaseTree(Miss &miss, LeaseHolder *holder)
+{
+    if (miss.key.empty())
+        return 0;
+    lock_guard<mutex> lock(cacheMutex);
+    if (!storable(miss, 0))
+        return 0;
+    TreeLease tl;
+    tl.root = miss.key.substr(1);
+    tl.dirs.insert(miss.dirs.begin(), miss.dirs.end());
+    tl.holder = holder;
+    tl.expires = chrono::steady_clock::now() + chrono::seconds(MAX_AGE);
+    // (takes over the references to the watches, each directory has
+    // been passed once)
+    miss.dirs.clear();
+    miss.key.clear();
+    treeLeases.push_back(tl);
+    return MAX_AGE - LEASE_MARGIN;
+}
+
+int MetadataCache::getEventFd()
+{
+    return isEnabled() ? inotifyFd : -1;
+}
+
+void MetadataCache::processEvents()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    drain();
+}
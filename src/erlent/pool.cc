@@ -0,0 +1,99 @@
+#include "erlent/buffer.hh"
+#include "erlent/erlent.hh"
+
+#include <cstdlib>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace erlent;
+
+// at most this many free objects are kept per buffer size or message type
+static const size_t MAX_FREE = 16;
+
+static const int NUM_CLASSES = 9;  // MIN_SIZE << 0 ... MIN_SIZE << 8 (= MAX_SIZE)
+
+static mutex bufferMutex;
+static vector<char *> freeBuffers[NUM_CLASSES];
+
+static int sizeClass(size_t size)
+{
+    int c = 0;
+    while ((BufferPool::MIN_SIZE << c) < size)
+        ++c;
+    return c;
+}
+
+size_t BufferPool::capacity(size_t size)
+{
+    return size > MAX_SIZE ? size : MIN_SIZE << sizeClass(size);
+}
+
+char *BufferPool::get(size_t size)
+{
+    if (size <= MAX_SIZE) {
+        int c = sizeClass(size);
+        {
+            lock_guard<mutex> lock(bufferMutex);
+            if (!freeBuffers[c].empty()) {
+                char *buf = freeBuffers[c].back();
+                freeBuffers[c].pop_back();
+                return buf;
+            }
+        }
+        size = MIN_SIZE << c;
+    }
+    char *buf = (char *)malloc(size);
+    if (buf == nullptr) {
+        cerr << "Could not allocate buffer of " << size << " bytes, exiting." << endl;
+        exit(1);
+    }
+    return buf;
+}
+
+void BufferPool::put(char *buf, size_t size)
+{
+    if (size <= MAX_SIZE) {
+        int c = sizeClass(size);
+        lock_guard<mutex> lock(bufferMutex);
+        if (freeBuffers[c].size() < MAX_FREE) {
+            freeBuffers[c].push_back(buf);
+            return;
+        }
+    }
+    free(buf);
+}
+
+
+static mutex requestMutex;
+static unordered_map<int, vector<Request *> > freeRequests;
+
+Request *RequestPool::get(Message::Type ty)
+{
+    {
+        lock_guard<mutex> lock(requestMutex);
+        vector<Request *> &reqs = freeRequests[ty];
+        if (!reqs.empty()) {
+            Request *req = reqs.back();
+            reqs.pop_back();
+            return req;
+        }
+    }
+    return Request::create(ty);
+}
+
+void RequestPool::put(Request *req)
+{
+    req->reset();
+    {
+        lock_guard<mutex> lock(requestMutex);
+        vector<Request *> &reqs = freeRequests[req->getMessageType()];
+        if (reqs.size() < MAX_FREE) {
+            reqs.push_back(req);
+            return;
+        }
+    }
+    delete req;
+}
@@ -0,0 +1,350 @@
+#include "erlent/local.hh"
+#include "erlent/remote.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+RemoteRequestProcessor::RemoteRequestProcessor(int infd, int outfd)
+    : conn(make_shared<Connection>(infd, outfd))
+{
+}
+
+// Stop the receiver thread first. A read() from a pipe cannot be
+// interrupted: the thread is left behind then, and the connection is
+// freed when it ends.
+RemoteRequestProcessor::~RemoteRequestProcessor()
+{
+    if (!receiver.joinable())
+        return;
+    if (conn->ch.interrupt())
+        receiver.join();
+    else
+        receiver.detach();
+}
+
+// Negotiate the protocol version with erlent-server. When only the
+// text protocol is enabled, no HELLO is sent so that servers not
+// knowing the handshake are still supported.
+void RemoteRequestProcessor::handshake()
+{
+    if (GlobalOptions::getMaxProtocol() == PROTOCOL_TEXT)
+        return;
+    unsigned features = GlobalOptions::getFeatures();
+    Channel &ch = conn->ch;
+    if (ch.hasSharedRing())
+        features |= FEATURE_SHARED_RING;
+    HelloRequest req(GlobalOptions::getMaxProtocol(), features);
+    HelloReply &repl = req.getReply();
+    req.send(ch);
+    repl.receive(ch);
+    dbg() << "using protocol version " << repl.getVersion()
+          << " with features 0x" << hex << repl.getFeatures() << dec << endl;
+    repl.configure(ch);
+}
+
+// Runs in its own thread (started on the first request, i.e. after
+// the FUSE process has been forked) and hands each reply to the
+// thread waiting for it, and INVALIDATE messages to the handler.
+void RemoteRequestProcessor::Connection::receiveReplies()
+{
+    Pending *p = nullptr;   // the request whose reply is being decoded
+    try {
+        for (;;) {
+            Decoder dec(ch);
+            int msgtype;
+            uint32_t tag;
+            Reply::receiveHeader(dec, msgtype, tag);
+            if (tag == 0) {
+                // pushed by erlent-server, not a reply
+                InvalidateReply msg;
+                msg.decode(dec, msgtype);
+                if (invalidationHandler) {
+                    for (const string &path : msg.getPathnames())
+                        invalidationHandler(path);
+                }
+                continue;
+            }
+
+            {
+                lock_guard<mutex> lock(m);
+                auto it = pending.find(tag);
+                if (it == pending.end()) {
+                    cerr << "Received reply with unknown tag " << tag
+                         << ", cannot continue." << endl;
+                    exit(1);
+                }
+                p = it->second;
+                pending.erase(it);
+            }
+            p->reply->decode(dec, msgtype);
+
+            lock_guard<mutex> lock(m);
+            p->done = true;
+            p->cv.notify_one();
+            p = nullptr;
+        }
+    } catch (EofException &e) {
+        // (it is not in 'pending' anymore)
+        if (p != nullptr) {
+            lock_guard<mutex> lock(m);
+            p->reply->setResult(-EIO);
+            p->done = true;
+            p->cv.notify_one();
+        }
+        close();
+    }
+}
+
+// erlent-server is gone, fail all outstanding and future requests.
+void RemoteRequestProcessor::Connection::close()
+{
+    lock_guard<mutex> lock(m);
+    closed = true;
+    for (auto &tp : pending) {
+        Pending *p = tp.second;
+        p->reply->setResult(-EIO);
+        p->done = true;
+        p->cv.notify_one();
+    }
+    pending.clear();
+}
+
+int RemoteRequestProcessor::process(Request &req)
+{
+    Pending p(&req.getReply());
+    start(req, p);
+    return finish(p);
+}
+
+void RemoteRequestProcessor::start(Request &req, Pending &p)
+{
+    Reply &repl = req.getReply();
+    Connection &c = *conn;
+    if (c.ch.getFormat() != BINARY) {
+        lock_guard<mutex> lock(textMutex);
+        try {
+            req.send(c.ch);
+            repl.receive(c.ch);
+        } catch (EofException &e) {
+            repl.setResult(-EIO);
+        }
+        p.done = true;
+    } else {
+        call_once(receiverStarted, [this]() {
+            receiver = thread(&Connection::receiveReplies, conn);
+        });
+
+        unique_lock<mutex> lock(c.m);
+        if (c.closed) {
+            repl.setResult(-EIO);
+            p.done = true;
+            return;
+        }
+        uint32_t tag = c.nextTag++;
+        if (c.nextTag == 0)     // tag 0 is never used for requests
+            c.nextTag = 1;
+        req.setTag(tag);
+        c.pending[tag] = &p;
+        lock.unlock();
+
+        try {
+            req.send(c.ch);
+        } catch (EofException &e) {
+            c.close();
+        }
+    }
+}
+
+int RemoteRequestProcessor::finish(Pending &p)
+{
+    unique_lock<mutex> lock(conn->m);
+    p.cv.wait(lock, [&p]() { return p.done; });
+    lock.unlock();
+
+    Reply &repl = *p.reply;
+    dbg() << "result is " << repl.getResultMessage() << endl;
+    return repl.getResult();
+}
+
+
+const char *const erlent::CHANNELS_ENV = "ERLENT_CHANNELS";
+const char *const erlent::RINGS_ENV = "ERLENT_RINGS";
+
+// (the channels are not inherited by the processes of the session)
+void StripedRequestProcessor::addChannel(int infd, int outfd)
+{
+    fcntl(infd, F_SETFD, FD_CLOEXEC);
+    fcntl(outfd, F_SETFD, FD_CLOEXEC);
+    channels.emplace_back(new RemoteRequestProcessor(infd, outfd));
+}
+
+void StripedRequestProcessor::addInheritedChannels()
+{
+    const char *env = getenv(CHANNELS_ENV);
+    if (env != nullptr) {
+        istringstream is(env);
+        int infd, outfd;
+        char comma;
+        while (is >> infd >> comma >> outfd && comma == ',')
+            addChannel(infd, outfd);
+        unsetenv(CHANNELS_ENV);
+    }
+    env = getenv(RINGS_ENV);
+    if (env != nullptr) {
+        istringstream is(env);
+        int memfd;
+        for (size_t i=0; i<channels.size() && is >> memfd; ++i) {
+            fcntl(memfd, F_SETFD, FD_CLOEXEC);
+            channels[i]->offerSharedRing(memfd);
+        }
+        unsetenv(RINGS_ENV);
+    }
+}
+
+void StripedRequestProcessor::setInvalidationHandler(const RemoteRequestProcessor::InvalidationHandler &handler)
+{
+    for (auto &rp : channels)
+        rp->setInvalidationHandler(handler);
+}
+
+void StripedRequestProcessor::handshake()
+{
+    for (auto &rp : channels)
+        rp->handshake();
+}
+
+int StripedRequestProcessor::process(Request &req)
+{
+    size_t n = channels.size();
+    switch (req.getMessageType()) {
+    case Message::READ: {
+        ReadRequest &rr = static_cast<ReadRequest &>(req);
+        if (n > 1 && rr.getSize() >= 2 * STRIPE_SIZE)
+            return processStriped(rr);
+        // fall through
+    }
+    case Message::WRITE:
+        return channels[nextChannel++ % n]->process(req);
+    default: {
+        size_t h = hash<string>()(req.getOrderingPath());
+        return channels[h % n]->process(req);
+    }
+    }
+}
+
+// Read the stripes on all channels at once; the result is the number
+// of bytes up to the first short stripe, or the error of the first
+// stripe.
+int StripedRequestProcessor::processStriped(ReadRequest &req)
+{
+    struct Stripe {
+        ReadRequest read;
+        RemoteRequestProcessor::Pending pending;
+        Stripe() : pending(&read.getReply()) { }
+    } stripes[MAX_STRIPES];
+
+    size_t size = req.getSize();
+    size_t perStripe = (size + MAX_STRIPES - 1) / MAX_STRIPES;
+    size_t stripeSize = (perStripe + STRIPE_SIZE - 1) / STRIPE_SIZE * STRIPE_SIZE;
+    size_t nstripes = (size + stripeSize - 1) / stripeSize;
+    char *data = req.getReply().getData();
+    unsigned first = nextChannel++;
+    for (size_t i=0; i<nstripes; ++i) {
+        ReadRequest &stripe = stripes[i].read;
+        size_t len = min(stripeSize, size - i*stripeSize);
+        stripe.setPathname(req.getPathname());
+        stripe.setSize(len);
+        stripe.setOffset(req.getOffset() + i*stripeSize);
+        stripe.getReply().init(data + i*stripeSize, len);
+        channels[(first + i) % channels.size()]->start(stripe, stripes[i].pending);
+    }
+
+    int res = 0;
+    bool complete = true;
+    for (size_t i=0; i<nstripes; ++i) {
+        int sres = channels[(first + i) % channels.size()]->finish(stripes[i].pending);
+        if (!complete)
+            continue;
+        if (sres < 0) {
+            if (i == 0)
+                res = sres;
+            complete = false;
+        } else {
+            res += sres;
+            complete = (size_t)sres == stripes[i].read.getSize();
+        }
+    }
+    req.getReply().setResult(res);
+    return res;
+}
+
+
+void RoutingRequestProcessor::addRoute(const string &prefix, bool isLocal)
+{
+    string p = prefix;
+    while (p.size() > 1 && *p.rbegin() == '/')
+        p.erase(p.size() - 1);
+    routes.push_back(make_pair(p, isLocal));
+    stable_sort(routes.begin(), routes.end(), [](const pair<string, bool> &a, const pair<string, bool> &b) {
+        return a.first.size() > b.first.size();
+    });
+}
+
+bool RoutingRequestProcessor::isLocal(const string &pathname) const
+{
+    for (auto &r : routes) {
+        const string &prefix = r.first;
+        if (pathname.compare(0, prefix.size(), prefix) == 0
+            && (pathname.size() == prefix.size() || prefix == "/" || pathname[prefix.size()] == '/'))
+            return r.second;
+    }
+    return false;
+}
+
+int RoutingRequestProcessor::sideOf(Request &req) const
+{
+    Message::Type ty = req.getMessageType();
+    if (ty == Message::COMPOUND) {
+        CompoundRequest &cr = static_cast<CompoundRequest &>(req);
+        int side = 0;
+        for (size_t i=0; i<cr.size(); ++i) {
+            int s = sideOf(cr.get(i));
+            if (i > 0 && s != side)
+                return -1;
+            side = s;
+        }
+        return side;
+    }
+    int n = LocalRequestProcessor::pathnameCount(ty);
+    if (n == 0)
+        return 0;
+    bool first = isLocal(static_cast<RequestWithPathname &>(req).getPathname());
+    if (n == 2 && isLocal(static_cast<RequestWithTwoPathnames &>(req).getPathname2()) != first)
+        return -1;
+    return first ? 1 : 0;
+}
+
+int RoutingRequestProcessor::process(Request &req)
+{
+    switch (sideOf(req)) {
+    case 1:
+        return local.process(req);
+    case 0:
+        return remote.process(req);
+    default:
+        if (req.getMessageType() == Message::COMPOUND)
+            return static_cast<CompoundRequest &>(req).processEach(*this);
+        req.getReply().setResult(-EXDEV);
+        return -EXDEV;
+    }
+}
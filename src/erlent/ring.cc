@@ -0,0 +1,165 @@
+#include "erlent/channel.hh"
+#include "erlent/erlent.hh"
+#include "erlent/ring.hh"
+
+#include <climits>
+#include <cstring>
+#include <new>
+
+extern "C" {
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+// iterations of polling the ring before going to sleep
+static const int SPIN_COUNT = 200;
+// a sleeping side checks whether the peer is still there this often
+static const long WAIT_TIMEOUT_NS = 100 * 1000 * 1000;
+
+static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+int SharedRing::create()
+{
+    int fd = syscall(SYS_memfd_create, "erlent-ring", 0);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, MAP_SIZE) == -1) {
+        ::close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        ::close(fd);
+        return -1;
+    }
+    new (p) Ring();
+    new ((char *)p + HEADER_SIZE / 2) Ring();
+    munmap(p, HEADER_SIZE);
+    return fd;
+}
+
+SharedRing::SharedRing(int memfd, bool creator)
+{
+    void *p = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) {
+        dbg() << "Mapping the shared ring failed: " << strerror(errno) << endl;
+        base = nullptr;
+        in = out = nullptr;
+        inData = outData = nullptr;
+        return;
+    }
+    base = (char *)p;
+    Ring *first = (Ring *)base, *second = (Ring *)(base + HEADER_SIZE / 2);
+    char *firstData = base + HEADER_SIZE, *secondData = firstData + RING_SIZE;
+    // the creator sends on the first ring
+    out     = creator ? first : second;
+    outData = creator ? firstData : secondData;
+    in      = creator ? second : first;
+    inData  = creator ? secondData : firstData;
+}
+
+SharedRing::~SharedRing()
+{
+    if (base == nullptr)
+        return;
+    close();
+    munmap(base, MAP_SIZE);
+}
+
+void SharedRing::close()
+{
+    for (Ring *ring : { in, out }) {
+        ring->closed = 1;
+        wake(ring->readerWaiting);
+        wake(ring->writerWaiting);
+    }
+}
+
+// Sleep until woken by the peer, but not longer than WAIT_TIMEOUT_NS;
+// the caller re-checks the ring. 'waiting' is set before the ring is
+// checked once more, so the peer (which checks 'waiting' after having
+// updated the ring) cannot miss it.
+void SharedRing::wait(atomic<uint32_t> &waiting, const Ring &ring, int peerfd)
+{
+    if (ring.closed)
+        throw EofException();
+    struct pollfd pfd;
+    pfd.fd = peerfd;
+    pfd.events = 0;
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+        throw EofException();
+
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = WAIT_TIMEOUT_NS;
+    syscall(SYS_futex, (uint32_t *)&waiting, FUTEX_WAIT, 1, &ts, NULL, 0);
+}
+
+void SharedRing::wake(atomic<uint32_t> &waiting)
+{
+    if (waiting.exchange(0) != 0)
+        syscall(SYS_futex, (uint32_t *)&waiting, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+size_t SharedRing::read(char *data, size_t len, int peerfd)
+{
+    uint64_t tail = in->tail.load(memory_order_relaxed);
+    uint64_t head = in->head.load(memory_order_acquire);
+    for (int spin = 0; head == tail; ++spin) {
+        if (spin >= SPIN_COUNT) {
+            in->readerWaiting = 1;
+            head = in->head.load();
+            if (head != tail)
+                break;
+            wait(in->readerWaiting, *in, peerfd);
+        }
+        head = in->head.load(memory_order_acquire);
+    }
+
+    size_t n = min((size_t)(head - tail), len);
+    size_t pos = tail % RING_SIZE;
+    size_t first = min(n, RING_SIZE - pos);
+    memcpy(data, inData + pos, first);
+    memcpy(data + first, inData, n - first);
+    in->tail.store(tail + n);
+    wake(in->writerWaiting);
+    return n;
+}
+
+void SharedRing::write(const char *data, size_t len, int peerfd)
+{
+    uint64_t head = out->head.load(memory_order_relaxed);
+    while (len > 0) {
+        uint64_t tail = out->tail.load(memory_order_acquire);
+        for (int spin = 0; head - tail == RING_SIZE; ++spin) {
+            if (spin >= SPIN_COUNT) {
+                out->writerWaiting = 1;
+                tail = out->tail.load();
+                if (head - tail != RING_SIZE)
+                    break;
+                wait(out->writerWaiting, *out, peerfd);
+            }
+            tail = out->tail.load(memory_order_acquire);
+        }
+        if (out->closed)
+            throw EofException();
+
+        size_t n = min((size_t)(RING_SIZE - (head - tail)), len);
+        size_t pos = head % RING_SIZE;
+        size_t first = min(n, RING_SIZE - pos);
+        memcpy(outData + pos, data, first);
+        memcpy(outData, data + first, n - first);
+        head += n;
+        out->head.store(head);
+        wake(out->readerWaiting);
+        data += n;
+        len -= n;
+    }
+}
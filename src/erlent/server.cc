@@ -0,0 +1,275 @@
+#include "erlent/server.hh"
+
+#include <functional>
+#include <iostream>
+
+extern "C" {
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+using namespace std;
+using namespace erlent;
+
+void Server::Queue::push(Request *req)
+{
+    lock_guard<mutex> lock(m);
+    requests.push_back(req);
+    cv.notify_one();
+}
+
+Request *Server::Queue::pop()
+{
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return !requests.empty(); });
+    Request *req = requests.front();
+    requests.pop_front();
+    return req;
+}
+
+
+
+WorkerPool::WorkerPool(unsigned nworkers)
+    : stopping(false)
+{
+    for (unsigned i=0; i<nworkers; ++i)
+        threads.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+        cv.notify_all();
+    }
+    for (thread &t : threads)
+        t.join();
+}
+
+void WorkerPool::push(Server *server, Request *req)
+{
+    size_t h = hash<string>()(req->getOrderingPath());
+    lock_guard<mutex> lock(m);
+    server->lanes[h % server->lanes.size()].requests.push_back(req);
+    ++server->pending;
+    schedule(server);
+}
+
+void WorkerPool::drain(Server *server)
+{
+    unique_lock<mutex> lock(m);
+    idle.wait(lock, [server]() { return server->pending == 0; });
+}
+
+// Called with the mutex held.
+void WorkerPool::schedule(Server *server)
+{
+    if (server->scheduled || server->runnableLane() == -1)
+        return;
+    ready.push_back(server);
+    server->scheduled = true;
+    cv.notify_one();
+}
+
+void WorkerPool::work()
+{
+    unique_lock<mutex> lock(m);
+    for (;;) {
+        cv.wait(lock, [this]() { return stopping || !ready.empty(); });
+        if (ready.empty())
+            return;
+        // take one request, then let the other servers have their turn
+        Server *server = ready.front();
+        ready.pop_front();
+        server->scheduled = false;
+        int i = server->runnableLane();
+        server->nextLane = (i + 1) % server->lanes.size();
+        Server::Lane &lane = server->lanes[i];
+        Request *req = lane.requests.front();
+        lane.requests.pop_front();
+        lane.busy = true;
+        schedule(server);
+
+        lock.unlock();
+        req->performNested(server->ch);
+        server->replyQueue.push(req);
+        lock.lock();
+
+        lane.busy = false;
+        schedule(server);
+        if (--server->pending == 0)
+            idle.notify_all();
+    }
+}
+
+
+Server::Server(Channel &ch, unsigned nworkers)
+    : Server(ch, nworkers == 0 ? nullptr : new WorkerPool(nworkers))
+{
+    ownPool.reset(pool);
+}
+
+Server::Server(Channel &ch, WorkerPool *pool)
+    : ch(ch), pool(pool), lanes(pool == nullptr ? 0 : pool->size()), nextLane(0),
+      pending(0), scheduled(false), stopPushing(false), wakeFd(-1)
+{
+    if (pool == nullptr)
+        return;
+    writer = thread(&Server::writeReplies, this);
+}
+
+Server::~Server()
+{
+    if (pool != nullptr) {
+        pool->drain(this);
+        replyQueue.push(nullptr);
+        writer.join();
+    }
+    if (pusher.joinable()) {
+        ch.setLeaseHolder(nullptr);
+        MetadataCache::releaseLeases(this);
+        {
+            lock_guard<mutex> lock(revokedMutex);
+            stopPushing = true;
+        }
+        wakePusher();
+        pusher.join();
+        close(wakeFd);
+    }
+}
+
+void Server::run()
+{
+    try {
+        for (;;) {
+            Request *req = Request::receive(ch);
+            if (pool == nullptr || ch.getFormat() == TEXT)
+                performInline(req);
+            else
+                dispatch(req);
+        }
+    } catch (EofException &e) {
+    }
+}
+
+void Server::performInline(Request *req)
+{
+    req->perform(ch);
+    if (req->getMessageType() == Message::HELLO) {
+        // the HELLO reply has been sent in the old format,
+        // switch to the negotiated one for all further messages
+        const HelloReply &repl = static_cast<HelloRequest *>(req)->getReply();
+        repl.configure(ch);
+        if (repl.getFeatures() & FEATURE_LEASES)
+            startLeases();
+    }
+    RequestPool::put(req);
+}
+
+void Server::dispatch(Request *req)
+{
+    req->receivePayload(ch);
+    pool->push(this, req);
+}
+
+// The next lane (in turn) with a request that can be performed now, or
+// -1; called with the mutex of the pool held.
+int Server::runnableLane()
+{
+    for (size_t n=0; n<lanes.size(); ++n) {
+        size_t i = (nextLane + n) % lanes.size();
+        if (!lanes[i].busy && !lanes[i].requests.empty())
+            return i;
+    }
+    return -1;
+}
+
+// Once the channel has been closed, replies are only discarded.
+void Server::writeReplies()
+{
+    bool closed = false;
+    while (Request *req = replyQueue.pop()) {
+        if (!closed) {
+            try {
+                req->getReply().send(ch);
+            } catch (EofException &e) {
+                closed = true;
+            }
+        }
+        RequestPool::put(req);
+    }
+}
+
+void Server::startLeases()
+{
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd == -1) {
+        int err = errno;
+        cerr << "Error creating eventfd: " << strerror(err) << endl;
+        exit(1);
+    }
+    ch.setLeaseHolder(this);
+    pusher = thread(&Server::pushRevocations, this);
+}
+
+void Server::revoke(const string &path)
+{
+    {
+        lock_guard<mutex> lock(revokedMutex);
+        revoked.push_back(path);
+    }
+    wakePusher();
+}
+
+void Server::wakePusher()
+{
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) == -1)
+        dbg() << "Cannot wake the pusher thread: " << strerror(errno) << endl;
+}
+
+// Changes are usually noticed before the next lookup in the metadata
+// cache, which may take a while; so the inotify events are handled
+// here as well as soon as they arrive.
+void Server::pushRevocations()
+{
+    struct pollfd fds[2];
+    fds[0].fd = wakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = MetadataCache::getEventFd();
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            int err = errno;
+            cerr << "Error in poll: " << strerror(err) << endl;
+            return;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t n;
+            if (read(wakeFd, &n, sizeof(n)) == -1)
+                dbg() << "Cannot read eventfd: " << strerror(errno) << endl;
+        }
+        if (fds[1].revents & POLLIN)
+            MetadataCache::processEvents();
+
+        InvalidateReply msg;
+        {
+            lock_guard<mutex> lock(revokedMutex);
+            if (stopPushing)
+                return;
+            for (const string &path : revoked)
+                msg.addPathname(path);
+            revoked.clear();
+        }
+        if (msg.getPathnames().empty())
+            continue;
+        try {
+            msg.send(ch);
+        } catch (EofException &e) {
+            return;
+        }
+    }
+}
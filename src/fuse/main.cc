@@ -1,16 +1,22 @@
 #define FUSE_USE_VERSION 30
 extern "C" {
 #include <fuse.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 }
 
+#include "erlent/blockcache.hh"
 #include "erlent/erlent.hh"
 #include "erlent/fuse.hh"
+#include "erlent/local.hh"
+#include "erlent/remote.hh"
 
 using namespace erlent;
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <climits>
 #include <errno.h>
@@ -21,60 +27,137 @@ using namespace erlent;
 
 using namespace std;
 
-class RemoteRequestProcessor : public RequestProcessor
-{
-public:
-    RemoteRequestProcessor() {
-        cout << unitbuf;
-    }
-
-    int process(Request &req) override {
-        ostream &os = cout;
-        istream &is = cin;
-        Reply &repl = req.getReply();
-/*
-        if (doLocally(req)) {
-            makePathLocal(req);
-            req.performLocally();
-        } else {
-        */
-            req.serialize(os);
-            os.flush();
-            repl.receive(is);
-//        }
-
-        dbg() << "result is " << repl.getResultMessage() << endl;
-        return repl.getResult();
-    }
-};
+static const size_t DEFAULT_READAHEAD = 4 * 1024 * 1024;
 
 static void usage(const char *progname)
 {
-    cerr << "USAGE: " << progname << " [-l PATH] [-L PATH] [-w DIR] [-d] [-h] [--] CMD ARGS..." << endl
-         << "   -l PATH      perform operations on PATH locally"
-         << "   -L PATH      perform operations on PATH remotely"
-         << "   -C           use default -l/-L settings for chroots"
+    cerr << "USAGE: " << progname << " [-l PATH] [-L PATH] [-M DIR] [-s SOCKET] [-w DIR] [-t] [-z] [-f] [-S] [-r KB] [-b DIR [-B MB]] [-d] [-h] [--] CMD ARGS..." << endl
+         << "   -l PATH      perform operations on PATH locally" << endl
+         << "   -L PATH      perform operations on PATH remotely (the default)" << endl
+         << "   -C           set up /dev, /proc and /sys inside the new root and perform" << endl
+         << "                operations on them locally" << endl
+         << "   -M DIR       fetch the attributes of everything below DIR at the start" << endl
+         << "                (needs the metadata cache of erlent-server)" << endl
+         << "   -s SOCKET    connect to erlent-server -s SOCKET" << endl
          << "   -w DIR       change working directory to DIR" << endl
+         << "   -t           only use the text protocol (no handshake)" << endl
+         << "   -z           compress file data and directory listings" << endl
+         << "   -f           read and write files opened by erlent-server directly" << endl
+         << "                (needs erlent-server -u)" << endl
+         << "   -S           send each write immediately (no write-back)" << endl
+         << "   -r KB        read at most KB KiB ahead of sequential reads (default "
+         << DEFAULT_READAHEAD / 1024 << ", 0 turns read-ahead off)" << endl
+         << "   -b DIR       keep the contents of files read in DIR for later sessions" << endl
+         << "   -B MB        limit the size of the cache in DIR (default "
+         << BlockCache::DEFAULT_MAX_BYTES / (1024 * 1024) << ")" << endl
          << "   -d           Turn debug messagen on" << endl
          << "   -h           print this help" << endl
-         << "   CMD ARGS...  command to execute and its arguments" << endl;
+         << "   CMD ARGS...  command to execute and its arguments" << endl
+         << endl
+         << "   Without -s, the standard input and output of erlent-fuse are connected to" << endl
+         << "   erlent-server; CMD reads from /dev/null and writes its standard output to" << endl
+         << "   standard error then." << endl;
+}
+
+static pid_t child_pid = 0;
+
+static void sigchld_action(int signum, siginfo_t *si, void *ctx)
+{
+    int status;
+
+    // do not consume the exit status of the child process
+    // because the main program needs it
+    if (si->si_pid == child_pid)
+        return;
+
+    waitpid(si->si_pid, &status, 0);
+}
+
+// Keep the channel to erlent-server on stdin/stdout away from the
+// command.
+static void moveChannel(int &infd, int &outfd)
+{
+    infd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    outfd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (infd == -1 || outfd == -1 || devnull == -1) {
+        perror("moving the channel to erlent-server");
+        exit(1);
+    }
+    dup2(devnull, STDIN_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    close(devnull);
+}
+
+static int connectSocket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        cerr << "Error connecting to " << path << ": " << strerror(err) << endl;
+        exit(1);
+    }
+    return fd;
 }
 
 int main(int argc, char *argv[])
 {
     ChildParams params;
-    RemoteRequestProcessor reqproc;
+    LocalRequestProcessor localproc;
+    StripedRequestProcessor reqproc;
+    RoutingRequestProcessor router(localproc, reqproc);
     int opt, usercmd;
+    const char *cacheDir = nullptr, *socketPath = nullptr;
+    uint64_t cacheBytes = BlockCache::DEFAULT_MAX_BYTES;
+    bool writeBack = true;
+    size_t readAhead = DEFAULT_READAHEAD;
 
     dbg() << unitbuf;
 
     char cwd[PATH_MAX];
     params.newWorkDir = getcwd(cwd, sizeof(cwd));
 
-    while ((opt = getopt(argc, argv, "+Cw:dh")) != -1) {
+    GlobalOptions::setFeatures(FEATURE_LEASES);
+    while ((opt = getopt(argc, argv, "+l:L:CM:s:w:tzfSr:b:B:dh")) != -1) {
         switch(opt) {
-        case 'C': params.devprocsys = true; break;
+        case 'l':
+        case 'L':
+            if (optarg[0] != '/') {
+                usage(argv[0]);
+                return 1;
+            }
+            router.addRoute(optarg, opt == 'l');
+            break;
+        case 'C':
+            params.devprocsys = true;
+            for (const char *path : { "/dev", "/proc", "/sys" })
+                router.addRoute(path, true);
+            break;
+        case 'M':
+            if (optarg[0] != '/') {
+                usage(argv[0]);
+                return 1;
+            }
+            erlent_add_manifest(optarg);
+            break;
+        case 's': socketPath = optarg; break;
         case 'w': params.newWorkDir = optarg; break;
+        case 't': GlobalOptions::setMaxProtocol(PROTOCOL_TEXT); break;
+        case 'z': GlobalOptions::setFeatures(GlobalOptions::getFeatures() | FEATURE_COMPRESSION); break;
+        case 'f': GlobalOptions::setFeatures(GlobalOptions::getFeatures() | FEATURE_FD_PASSING); break;
+        case 'S': writeBack = false; break;
+        case 'r': readAhead = strtoull(optarg, NULL, 10) * 1024; break;
+        case 'b': cacheDir = optarg; break;
+        case 'B': cacheBytes = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
         case 'd': GlobalOptions::setDebug(true); break;
         case 'h': usage(argv[0]); return 0;
         default:
@@ -96,10 +179,49 @@ int main(int argc, char *argv[])
 
     uid_t euid = geteuid();
     gid_t egid = getegid();
+    params.initialUID = euid;
+    params.initialGID = egid;
     if (params.uidMappings.empty())
         params.uidMappings.push_back(Mapping(euid, euid, 1));
     if (params.gidMappings.empty())
         params.gidMappings.push_back(Mapping(egid, egid, 1));
-    cerr << "IMPLEMENTATION INCOMPLETE" << endl;
-    return 127; //erlent_fuse(reqproc, args, params);
+    localproc.setParams(params);
+
+    if (writeBack)
+        erlent_enable_write_back();
+    if (readAhead > 0)
+        erlent_enable_read_ahead(readAhead);
+    if (cacheDir != nullptr)
+        BlockCache::enable(cacheDir, cacheBytes);
+    if (socketPath != nullptr) {
+        int fd = connectSocket(socketPath);
+        reqproc.addChannel(fd, fd);
+    } else {
+        int infd, outfd;
+        moveChannel(infd, outfd);
+        reqproc.addChannel(infd, outfd);
+        reqproc.addInheritedChannels();
+    }
+    reqproc.setInvalidationHandler(erlent_revoke_lease);
+    reqproc.handshake();
+
+    struct sigaction sact;
+    memset(&sact, 0, sizeof(sact));
+    sact.sa_sigaction = sigchld_action;
+    sact.sa_flags = SA_NOCLDSTOP | SA_SIGINFO;
+    if (sigaction(SIGCHLD, &sact, 0) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    child_pid = setup_child(args, params);
+    // run_child() is called by erlent_fuse()
+    pid_t fuse_pid = erlent_fuse(child_pid, router, true);
+    wait_child_chroot();
+    parent_fuse_preclean();
+
+    int exitcode = wait_for_pid(child_pid, {child_pid, fuse_pid});
+    kill(fuse_pid, SIGTERM);
+    wait_for_pid(fuse_pid, {});
+    return exitcode;
 }
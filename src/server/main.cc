@@ -1,51 +1,119 @@
 #include "erlent/erlent.hh"
+#include "erlent/metacache.hh"
+#include "erlent/remote.hh"
+#include "erlent/ring.hh"
+#include "erlent/server.hh"
 
 #include <istream>
 #include <ostream>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
 extern "C" {
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 }
 
 using namespace std;
 using namespace erlent;
 
-bool processMessage()
-{
-    istream &is = cin;
-    ostream &os = cout;
-
-    Request *req = Request::receive(is);
-    req->perform(os);
-    os.flush();
-    return true;
-}
-
 static pid_t child_pid;
 
-static void startchild(int argc, char *argv[])
+// the (input, output) fds of the channels to the child besides stdin/stdout
+static vector<pair<int,int>> extraChannels;
+// the memfds of the shared rings of all channels (if any), stdin/stdout first
+static vector<int> rings;
+
+// Create a channel to the child: a pair of pipes or an AF_UNIX socket
+// (the same fd for input and output then).
+static void makeChannel(bool unixSocket, pair<int,int> &parent, pair<int,int> &child)
 {
+    if (unixSocket) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+            int err = errno;
+            cerr << "Error creating socket: " << strerror(err) << endl;
+            exit(1);
+        }
+        // the child's end is inherited
+        fcntl(sv[1], F_SETFD, 0);
+        parent = make_pair(sv[0], sv[0]);
+        child = make_pair(sv[1], sv[1]);
+        return;
+    }
     int tochild[2], toparent[2];
-    if (pipe(tochild) == -1 || pipe(toparent)) {
+    if (pipe(tochild) == -1 || pipe(toparent) == -1) {
         int err = errno;
         cerr << "Error creating pipes: " << strerror(err) << endl;
         exit(1);
     }
+    parent = make_pair(toparent[0], tochild[1]);
+    child = make_pair(tochild[0], toparent[1]);
+}
+
+static void closeChannel(const pair<int,int> &fds)
+{
+    close(fds.first);
+    if (fds.second != fds.first)
+        close(fds.second);
+}
+
+static void startchild(int argc, char *argv[], unsigned nchannels, bool unixSocket, bool sharedRings)
+{
+    pair<int,int> parent, child;
+    makeChannel(unixSocket, parent, child);
+    // the child's ends of the additional channels
+    vector<pair<int,int>> childChannels;
+    for (unsigned i=1; i<nchannels; ++i) {
+        pair<int,int> p, c;
+        makeChannel(unixSocket, p, c);
+        childChannels.push_back(c);
+        extraChannels.push_back(p);
+    }
+    for (unsigned i=0; sharedRings && i<nchannels; ++i) {
+        int memfd = SharedRing::create();
+        if (memfd == -1) {
+            int err = errno;
+            cerr << "Error creating shared memory: " << strerror(err) << endl;
+            exit(1);
+        }
+        rings.push_back(memfd);
+    }
     child_pid = fork();
     if (child_pid == -1) {
         int err = errno;
         cerr << "Error in fork: " << strerror(err) << endl;
         exit(1);
     } else if (child_pid == 0) {
-        close(tochild[1]);
-        close(toparent[0]);
-        dup2(tochild[0], 0);
-        dup2(toparent[1], 1);
-        close(tochild[0]);
-        close(toparent[1]);
+        closeChannel(parent);
+        dup2(child.first, 0);
+        dup2(child.second, 1);
+        closeChannel(child);
+
+        if (!childChannels.empty()) {
+            ostringstream fds;
+            for (size_t i=0; i<childChannels.size(); ++i) {
+                closeChannel(extraChannels[i]);
+                fds << (i > 0 ? " " : "") << childChannels[i].first << "," << childChannels[i].second;
+            }
+            setenv(CHANNELS_ENV, fds.str().c_str(), 1);
+        }
+        if (!rings.empty()) {
+            ostringstream fds;
+            for (size_t i=0; i<rings.size(); ++i)
+                fds << (i > 0 ? " " : "") << rings[i];
+            setenv(RINGS_ENV, fds.str().c_str(), 1);
+        }
 
         char **args = new char* [argc+1];
         for (int i=0; i<argc; ++i)
@@ -58,18 +126,117 @@ static void startchild(int argc, char *argv[])
         exit(127);
     }
 
-    close(tochild[0]);
-    close(toparent[1]);
+    closeChannel(child);
+    for (auto &fds : childChannels)
+        closeChannel(fds);
 
-    dup2(tochild[1], 1);
-    dup2(toparent[0], 0);
+    dup2(parent.second, 1);
+    dup2(parent.first, 0);
+    closeChannel(parent);
+}
+
+// the socket of serveClients(), removed when erlent-server ends
+static const char *boundPath = nullptr;
+
+static void removeSocket()
+{
+    unlink(boundPath);
+}
 
-    close(tochild[1]);
-    close(toparent[0]);
+static void removeSocketAndDie(int sig)
+{
+    unlink(boundPath);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// A socket left behind by an erlent-server that did not end normally
+// is removed, unless a server still accepts connections on it.
+static void removeStaleSocket(const struct sockaddr_un &addr)
+{
+    struct stat st;
+    if (lstat(addr.sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+        return;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1)
+        return;
+    if (connect(probe, (const struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED) {
+        dbg() << "Removing stale socket " << addr.sun_path << endl;
+        unlink(addr.sun_path);
+    }
+    close(probe);
+}
+
+// Serve each client connecting to the Unix socket 'path' in its own
+// thread; all of them share the workers (if any) and the caches.
+static void serveClients(const char *path, unsigned nworkers)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    removeStaleSocket(addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        cerr << "Error listening on " << path << ": " << strerror(err) << endl;
+        exit(1);
+    }
+    boundPath = path;
+    atexit(removeSocket);
+    for (int sig : { SIGTERM, SIGINT, SIGHUP })
+        signal(sig, removeSocketAndDie);
+    if (listen(sock, SOMAXCONN) == -1) {
+        int err = errno;
+        cerr << "Error listening on " << path << ": " << strerror(err) << endl;
+        exit(1);
+    }
+    // a client going away must not end the other sessions
+    signal(SIGPIPE, SIG_IGN);
+
+    unique_ptr<WorkerPool> pool;
+    if (nworkers > 0)
+        pool.reset(new WorkerPool(nworkers));
+    WorkerPool *workers = pool.get();
+    for (;;) {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            int err = errno;
+            cerr << "Error in accept: " << strerror(err) << endl;
+            exit(1);
+        }
+        dbg() << "New client on fd " << fd << endl;
+        thread([fd, workers]() {
+            {
+                Channel ch(fd, fd);
+                Server server(ch, workers);
+                server.run();
+            }
+            close(fd);
+            dbg() << "Client on fd " << fd << " is gone" << endl;
+        }).detach();
+    }
 }
 
 void usage(const char *progname) {
-    cerr << "USAGE: " << progname << "[-d] [-h] [--] CMD ARGS..." << endl
+    cerr << "USAGE: " << progname << "[-t] [-u] [-m] [-j N] [-c N] [-C] [-d] [-h] [--] CMD ARGS..." << endl
+         << "       " << progname << "[-t] [-j N] [-C] [-d] -s SOCKET" << endl
+         << "   -t           only use the text protocol" << endl
+         << "   -u           connect to the command with Unix sockets instead of pipes" << endl
+         << "                (file descriptors can be passed to erlent-fuse -f then)" << endl
+         << "   -m           exchange messages through shared memory with erlent-fuse" << endl
+         << "   -j N         perform requests concurrently with N worker threads" << endl
+         << "   -c N         open N channels to the command (for erlent-fuse)" << endl
+         << "   -C           do not cache file attributes and directory listings" << endl
+         << "   -s SOCKET    serve any number of clients (erlent-fuse -s) connecting to" << endl
+         << "                the Unix socket SOCKET instead of executing a command" << endl
          << "   -h           show this help" << endl
          << "   -d           show debug messages" << endl
          << "   CMD ARGS...  command to execute and its arguments" << endl;
@@ -78,11 +245,21 @@ void usage(const char *progname) {
 int main(int argc, char *argv[])
 {
     int opt, usercmd;
+    unsigned nworkers = 0, nchannels = 1;
+    bool unixSocket = false, sharedRings = false, cacheMetadata = true;
+    const char *socketPath = nullptr;
 
     child_pid = 0;
 
-    while ((opt = getopt(argc, argv, "+dh")) != -1) {
+    while ((opt = getopt(argc, argv, "+tumj:c:Cs:dh")) != -1) {
         switch(opt) {
+        case 't': GlobalOptions::setMaxProtocol(PROTOCOL_TEXT); break;
+        case 'u': unixSocket = true; break;
+        case 'm': sharedRings = true; break;
+        case 'j': nworkers = strtoul(optarg, NULL, 10); break;
+        case 'c': nchannels = strtoul(optarg, NULL, 10); break;
+        case 'C': cacheMetadata = false; break;
+        case 's': socketPath = optarg; break;
         case 'd': GlobalOptions::setDebug(true); break;
         case 'h': usage(argv[0]); return 0;
         default:
@@ -91,19 +268,52 @@ int main(int argc, char *argv[])
     }
     usercmd = optind;
 
+    if (socketPath != nullptr) {
+        if (usercmd < argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (cacheMetadata)
+            MetadataCache::enable();
+        serveClients(socketPath, nworkers);
+        return 0;
+    }
+
     if (usercmd >= argc) {
         usage(argv[0]);
         return 1;
     }
 
-    startchild(argc-usercmd, &argv[usercmd]);
+    startchild(argc-usercmd, &argv[usercmd], nchannels, unixSocket, sharedRings);
+    if (cacheMetadata)
+        MetadataCache::enable();
+
+    // one server for each channel, the additional ones in their own threads
+    vector<thread> extraServers;
+    for (size_t i=0; i<extraChannels.size(); ++i) {
+        pair<int,int> fds = extraChannels[i];
+        int ring = rings.empty() ? -1 : rings[i+1];
+        extraServers.emplace_back([fds, ring, nworkers]() {
+            {
+                Channel ch(fds.first, fds.second);
+                if (ring != -1)
+                    ch.offerSharedRing(ring, true);
+                Server server(ch, nworkers);
+                server.run();
+            }
+            closeChannel(fds);
+        });
+    }
 
-    try {
-        cout << unitbuf;
-        do {
-        } while (processMessage());
-    } catch (EofException &e) {
+    {
+        Channel ch(STDIN_FILENO, STDOUT_FILENO);
+        if (!rings.empty())
+            ch.offerSharedRing(rings[0], true);
+        Server server(ch, nworkers);
+        server.run();
     }
+    for (thread &t : extraServers)
+        t.join();
 
     int res = 0;
 